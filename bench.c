@@ -0,0 +1,200 @@
+/* bench.c - Send path and checksum microbenchmarks for Atari Portfolio */
+
+#include <stdlib.h>
+#include <string.h>
+#include <conio.h>
+#include "network.h"
+#include "platform.h"
+
+#define BENCH_PACKETS 250
+#define BENCH_PAYLOAD TCP_MSS
+#define CKSUM_KB      256   /* Data summed per checksum benchmark */
+#define CKSUM_CHECKS  2000  /* Random buffers compared */
+
+extern volatile unsigned char tx_active;  /* pal_dos.c */
+
+unsigned char bench_data[BENCH_PAYLOAD];
+unsigned char cksum_data[1024 + 1];
+
+/*============================================================================
+ * Reference Send Path
+ *============================================================================*/
+
+/* The send path before fusing: copy into a TCP buffer, sum it, copy it
+   behind an IP header, then escape the whole packet into the queue. */
+unsigned char ref_tcp_buf[TCP_HEADER_LEN + BENCH_PAYLOAD];
+unsigned char ref_ip_buf[IP_HEADER_LEN + TCP_HEADER_LEN + BENCH_PAYLOAD];
+
+void ref_send(unsigned char *data, unsigned short data_len) {
+    unsigned short tcp_len = TCP_HEADER_LEN + data_len;
+    unsigned short i, head;
+    unsigned char c;
+
+    memset(ref_tcp_buf, 0, TCP_HEADER_LEN);
+    ref_tcp_buf[TCP_DATA_OFF] = 0x50;
+    ref_tcp_buf[TCP_FLAGS] = TCP_PSH | TCP_ACK;
+    memcpy(&ref_tcp_buf[TCP_HEADER_LEN], data, data_len);
+    put_u16(&ref_tcp_buf[TCP_CHECKSUM],
+            tcp_checksum(ref_tcp_buf, tcp_len, local_ip, tcp_conns[0].remote_ip));
+
+    ip_build_header(ref_ip_buf, tcp_conns[0].remote_ip, IP_PROTO_TCP, tcp_len);
+    memcpy(&ref_ip_buf[IP_HEADER_LEN], ref_tcp_buf, tcp_len);
+
+    head = tx_head;
+    tx_queue[head] = SLIP_END;
+    head = (head + 1) & TX_QUEUE_MASK;
+    for (i = 0; i < IP_HEADER_LEN + tcp_len; i++) {
+        c = ref_ip_buf[i];
+        if (c == SLIP_END) {
+            tx_queue[head] = SLIP_ESC;
+            head = (head + 1) & TX_QUEUE_MASK;
+            c = SLIP_ESC_END;
+        } else if (c == SLIP_ESC) {
+            tx_queue[head] = SLIP_ESC;
+            head = (head + 1) & TX_QUEUE_MASK;
+            c = SLIP_ESC_ESC;
+        }
+        tx_queue[head] = c;
+        head = (head + 1) & TX_QUEUE_MASK;
+    }
+    tx_queue[head] = SLIP_END;
+    tx_head = (head + 1) & TX_QUEUE_MASK;
+}
+
+/*============================================================================
+ * Benchmarks
+ *============================================================================*/
+
+void report(char *name, unsigned long ticks) {
+    print_str(name);
+    print_ulong(ticks);
+    print_str(" ticks, ");
+    print_ulong(ticks * 102400UL / ((unsigned long)BENCH_PACKETS * BENCH_PAYLOAD));
+    print_str(" ticks/100KB\r\n");
+}
+
+void report_kb(char *name, unsigned long ticks) {
+    print_str(name);
+    print_ulong(ticks);
+    print_str(" ticks, ");
+    print_ulong(ticks * 100UL / CKSUM_KB);
+    print_str(" ticks/100KB\r\n");
+}
+
+unsigned long bench_send(unsigned char fused) {
+    unsigned short n;
+    unsigned long start = get_tick_count();
+
+    for (n = 0; n < BENCH_PACKETS; n++) {
+        tx_tail = tx_head;  /* Pretend the UART drained the last frame */
+        if (fused) {
+            tcp_send_flags(&tcp_conns[0], TCP_PSH | TCP_ACK, bench_data, BENCH_PAYLOAD);
+        } else {
+            ref_send(bench_data, BENCH_PAYLOAD);
+        }
+    }
+    return get_tick_count() - start;
+}
+
+unsigned long bench_checksum(unsigned char use_asm) {
+    unsigned short n;
+    unsigned long sum = 0;
+    unsigned long start = get_tick_count();
+
+    for (n = 0; n < CKSUM_KB; n++) {
+        if (use_asm) {
+            sum = checksum_add(sum, cksum_data, 1024);
+        } else {
+            sum = checksum_add_c(sum, cksum_data, 1024);
+        }
+    }
+    return get_tick_count() - start;
+}
+
+/* Both versions must agree on random lengths, alignments and start sums.
+   Without -DASM_CHECKSUM there is only the C one, and nothing to check. */
+unsigned short check_checksum(void) {
+    unsigned short n, i, off, len, failures = 0;
+    unsigned long sum;
+
+    for (n = 0; n < CKSUM_CHECKS; n++) {
+        off = rand() & 1;
+        len = rand() % (sizeof(cksum_data) - 1);
+        for (i = 0; i < len; i++) {
+            cksum_data[off + i] = (rand() & 3) ? (unsigned char)rand() : 0xFF;
+        }
+        sum = ((unsigned long)rand() << 16) | (unsigned short)rand();
+        if (checksum_fold(checksum_add(sum, &cksum_data[off], len)) !=
+            checksum_fold(checksum_add_c(sum, &cksum_data[off], len))) {
+            failures++;
+        }
+    }
+    return failures;
+}
+
+/*============================================================================
+ * Network Callbacks (unused)
+ *============================================================================*/
+
+void app_tcp_data_received(unsigned char conn, unsigned char *data, unsigned short len) {
+    (void)conn;
+    (void)data;
+    (void)len;
+}
+
+void app_tcp_state_changed(unsigned char conn, unsigned char old_state,
+                           unsigned char new_state,
+                           unsigned long remote_ip, unsigned short remote_port) {
+    (void)conn;
+    (void)old_state;
+    (void)new_state;
+    (void)remote_ip;
+    (void)remote_port;
+}
+
+unsigned char app_tcp_accept(unsigned long remote_ip, unsigned short remote_port) {
+    (void)remote_ip;
+    (void)remote_port;
+    return 0;
+}
+
+/*============================================================================
+ * Main
+ *============================================================================*/
+
+int main(void) {
+    unsigned short i;
+
+    for (i = 0; i < BENCH_PAYLOAD; i++) {
+        bench_data[i] = (unsigned char)(i * 37);
+    }
+    tcp_set_remote(0, 0xC0A80101UL, 80);
+    tx_active = 1;  /* Keep tx_kick away from the UART */
+
+    print_str("Send path, "); print_uint(BENCH_PACKETS);
+    print_str(" x "); print_uint(BENCH_PAYLOAD); print_str(" byte segments\r\n");
+    report("  copy+sum+copy+escape: ", bench_send(0));
+    report("  fused escape+sum:     ", bench_send(1));
+
+#ifdef ASM_CHECKSUM
+    print_str("Checksum check, "); print_uint(CKSUM_CHECKS); print_str(" buffers: ");
+    i = check_checksum();
+    if (i == 0) {
+        print_str("OK\r\n");
+    } else {
+        print_uint(i); print_str(" MISMATCHED\r\n");
+    }
+#endif
+    for (i = 0; i < sizeof(cksum_data); i++) {
+        cksum_data[i] = (unsigned char)(i * 37);
+    }
+    print_str("Checksum, "); print_uint(CKSUM_KB); print_str(" KB\r\n");
+    report_kb("  C:   ", bench_checksum(0));
+#ifdef ASM_CHECKSUM
+    report_kb("  asm: ", bench_checksum(1));
+#endif
+
+    tx_active = 0;
+    tx_tail = tx_head;
+    return 0;
+}
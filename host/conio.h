@@ -0,0 +1,11 @@
+/* conio.h - OpenWatcom console calls for the POSIX host build */
+
+#ifndef HOST_CONIO_H
+#define HOST_CONIO_H
+
+/* Implemented in pal_posix.c */
+int putch(int c);
+int kbhit(void);
+int getch(void);
+
+#endif /* HOST_CONIO_H */
@@ -0,0 +1,41 @@
+/* dos.h - OpenWatcom DOS file calls for the POSIX host build */
+
+#ifndef HOST_DOS_H
+#define HOST_DOS_H
+
+#include <strings.h>
+
+/* Watcom declares these in string.h */
+#define stricmp strcasecmp
+#define strnicmp strncasecmp
+
+/* File attributes */
+#define _A_NORMAL 0x00
+#define _A_RDONLY 0x01
+#define _A_HIDDEN 0x02
+#define _A_SYSTEM 0x04
+#define _A_VOLID  0x08
+#define _A_SUBDIR 0x10
+#define _A_ARCH   0x20
+
+/* Directory search result, laid out as in Watcom's dos.h */
+struct find_t {
+    char           reserved[21];
+    char           attrib;
+    unsigned short wr_time;
+    unsigned short wr_date;
+    unsigned long  size;
+    char           name[13];
+};
+
+/* Implemented in pal_posix.c - return 0 on success like their DOS
+   counterparts. Paths may use '\' separators. */
+unsigned _dos_open(const char *path, unsigned mode, int *handle);
+unsigned _dos_creat(const char *path, unsigned attr, int *handle);
+unsigned _dos_read(int handle, void *buf, unsigned count, unsigned *bytes);
+unsigned _dos_write(int handle, const void *buf, unsigned count, unsigned *bytes);
+unsigned _dos_close(int handle);
+unsigned _dos_findfirst(const char *path, unsigned attr, struct find_t *buf);
+unsigned _dos_findnext(struct find_t *buf);
+
+#endif /* HOST_DOS_H */
@@ -12,9 +12,15 @@
  *============================================================================*/
 
 unsigned short http_requests = 0;
+unsigned short http_timeouts = 0;
 
-/* File read buffer */
-unsigned char file_buf[64];
+/* Time allowed for a client to send all of its request headers, and
+   for its next request on a connection kept open */
+#define HTTP_REQUEST_TIMEOUT   182  /* ticks (~10s) */
+#define HTTP_KEEPALIVE_TIMEOUT 182  /* ticks (~10s) */
+
+/* Content length of a response whose body ends with the connection */
+#define HTTP_NO_LENGTH 0xFFFFFFFFUL
 
 /* Document root path */
 char doc_root[64] = ".";
@@ -22,18 +28,30 @@ char doc_root[64] = ".";
 /* PUT upload enabled flag */
 unsigned char allow_put = 0;
 
-/* PUT upload state */
-unsigned char put_in_progress = 0;
-unsigned long put_content_length = 0;
-unsigned long put_bytes_received = 0;
-int put_file = -1;
-
-/* HTTP response templates */
-char http_200[] = "HTTP/1.0 200 OK\r\nContent-Type: ";
-char http_404[] = "HTTP/1.0 404 Not Found\r\nContent-Type: text/html\r\n\r\n"
-                  "<html><body><h1>404 Not Found</h1></body></html>";
-char http_405[] = "HTTP/1.0 405 Method Not Allowed\r\n\r\n";
-char http_crlf[] = "\r\n\r\n";
+/* Per-connection state, indexed by TCP connection handle */
+struct http_conn {
+    unsigned char  req[1024];            /* Request headers so far */
+    unsigned short req_len;
+    unsigned long  req_time;             /* When the request began, or when idle */
+    unsigned char  keep_alive;           /* Connection stays open after the response */
+    unsigned char  idle;                 /* Kept open, waiting for the next request */
+    int            send_file;            /* File being sent, or -1 */
+    unsigned long  send_left;            /* Bytes of it still to read */
+    unsigned char  put_in_progress;
+    unsigned long  put_content_length;
+    unsigned long  put_bytes_received;
+    int            put_file;
+};
+
+struct http_conn http_conns[TCP_MAX_CONNS];
+
+/* HTTP response status lines and bodies */
+char http_200[] = "200 OK";
+char http_201[] = "201 Created";
+char http_304[] = "304 Not Modified";
+char http_404[] = "404 Not Found";
+char http_405[] = "405 Method Not Allowed";
+char http_404_body[] = "<html><body><h1>404 Not Found</h1></body></html>";
 
 /* MIME types */
 char mime_html[] = "text/html";
@@ -42,6 +60,17 @@ char mime_jpeg[] = "image/jpeg";
 char mime_gif[]  = "image/gif";
 char mime_bin[]  = "application/octet-stream";
 
+/* Names for HTTP dates */
+char day_names[] = "SunMonTueWedThuFriSat";
+char month_names[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+unsigned short month_days[] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+
+/* What a client can check its cached copy of a response against */
+struct http_validator {
+    char etag[20];                       /* "size-stamp" in hex, quoted */
+    char date[30];                       /* Last-Modified */
+};
+
 /* Directory listing HTML */
 char dir_header[] = "<html><head><title>Directory</title></head><body><h1>Index of ";
 char dir_mid[] = "</h1><hr><pre>\n";
@@ -98,6 +127,47 @@ unsigned long parse_content_length(char *headers) {
     return len;
 }
 
+/* Value of a request header, or NULL if it wasn't sent */
+char *find_header(char *headers, char *name, char *lower_name) {
+    char *p;
+
+    p = strstr(headers, name);
+    if (p == NULL) {
+        p = strstr(headers, lower_name);
+    }
+    if (p == NULL) {
+        return NULL;
+    }
+
+    p += strlen(name);
+    while (*p == ' ') p++; /* Skip spaces */
+    return p;
+}
+
+/* Whether the client wants the connection kept open after the response:
+   unless it says otherwise, HTTP/1.1 does and HTTP/1.0 doesn't */
+unsigned char parse_keep_alive(char *headers) {
+    char *p;
+
+    p = strstr(headers, "Connection:");
+    if (p == NULL) {
+        p = strstr(headers, "connection:");
+    }
+    if (p != NULL) {
+        p += 11; /* Skip "Connection:" */
+        while (*p == ' ') p++;
+        if (strnicmp(p, "close", 5) == 0) {
+            return 0;
+        }
+        if (strnicmp(p, "keep-alive", 10) == 0) {
+            return 1;
+        }
+    }
+
+    p = strstr(headers, "\r\n");
+    return p != NULL && p - headers >= 8 && strncmp(p - 8, "HTTP/1.1", 8) == 0;
+}
+
 /* Parse request path from HTTP request - returns method (1=GET, 2=PUT) */
 unsigned char parse_request(char *request, char *path, unsigned char path_size) {
     char *p, *end;
@@ -179,61 +249,286 @@ unsigned char is_directory(char *path) {
     return 0;
 }
 
-/* Send a file as HTTP response */
-void send_file(char *filename) {
+/* Write n as eight hex digits */
+char *put_hex(char *p, unsigned long n) {
+    unsigned char i;
+
+    for (i = 0; i < 8; i++) {
+        *p++ = "0123456789abcdef"[(unsigned short)(n >> 28) & 15];
+        n <<= 4;
+    }
+    return p;
+}
+
+/* Write n (0-99) as two digits */
+char *put_2digits(char *p, unsigned char n) {
+    *p++ = '0' + n / 10;
+    *p++ = '0' + n % 10;
+    return p;
+}
+
+/* Fill in the ETag and Last-Modified for a body of the given size (or
+   a checksum standing in for it) and DOS date/time stamp. DOS keeps
+   local time and no time zone, so it's given as GMT. */
+void make_validator(struct http_validator *v, unsigned long size, unsigned long stamp) {
+    char *p;
+    unsigned short date = (unsigned short)(stamp >> 16);
+    unsigned short time = (unsigned short)stamp;
+    unsigned short year = 1980 + (date >> 9);
+    unsigned char month = (date >> 5) & 15;
+    unsigned char day = date & 31;
+    unsigned short days;
+
+    p = v->etag;
+    *p++ = '"';
+    p = put_hex(p, size);
+    *p++ = '-';
+    p = put_hex(p, stamp);
+    *p++ = '"';
+    *p = '\0';
+
+    if (month < 1 || month > 12) {
+        month = 1;
+    }
+
+    /* Day of the week, counting from Tuesday 1 January 1980 */
+    days = (year - 1980) * 365 + (year - 1977) / 4 + month_days[month - 1] + day - 1;
+    if (month > 2 && (year & 3) == 0) {
+        days++;
+    }
+
+    /* "Sun, 06 Nov 1994 08:49:37 GMT" */
+    p = v->date;
+    memcpy(p, &day_names[((days + 2) % 7) * 3], 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p = put_2digits(p, day);
+    *p++ = ' ';
+    memcpy(p, &month_names[(month - 1) * 3], 3);
+    p += 3;
+    *p++ = ' ';
+    p = put_2digits(p, (unsigned char)(year / 100));
+    p = put_2digits(p, (unsigned char)(year % 100));
+    *p++ = ' ';
+    p = put_2digits(p, (unsigned char)(time >> 11));
+    *p++ = ':';
+    p = put_2digits(p, (unsigned char)((time >> 5) & 63));
+    *p++ = ':';
+    p = put_2digits(p, (unsigned char)((time & 31) * 2));
+    strcpy(p, " GMT");
+}
+
+/* Whether the client's cached copy is still good. If-None-Match wins
+   over If-Modified-Since, which is taken to match when it is the date
+   this server gave, as clients send that back unchanged. */
+unsigned char not_modified(unsigned char conn, struct http_validator *v) {
+    char *headers = (char *)http_conns[conn].req;
+    char *p, *end, *match;
+
+    p = find_header(headers, "If-None-Match:", "if-none-match:");
+    if (p != NULL) {
+        if (*p == '*') {
+            return 1;
+        }
+        match = strstr(p, v->etag);
+        end = strstr(p, "\r\n");
+        return match != NULL && (end == NULL || match < end);
+    }
+
+    p = find_header(headers, "If-Modified-Since:", "if-modified-since:");
+    return p != NULL && strncmp(p, v->date, strlen(v->date)) == 0;
+}
+
+/* Write the ETag and Last-Modified headers */
+void http_validator_headers(unsigned char conn, struct http_validator *v) {
+    tcp_write_str(conn, "\r\nETag: ");
+    tcp_write_str(conn, v->etag);
+    tcp_write_str(conn, "\r\nLast-Modified: ");
+    tcp_write_str(conn, v->date);
+}
+
+/* Write the Connection header and the blank line after the headers */
+void http_end_headers(unsigned char conn) {
+    tcp_write_str(conn, http_conns[conn].keep_alive ? "\r\nConnection: keep-alive\r\n\r\n"
+                                                    : "\r\nConnection: close\r\n\r\n");
+}
+
+/* Write the status line and headers. Without a length the body runs
+   until the connection closes, so it won't be kept open. */
+void http_headers(unsigned char conn, char *status, char *mime, unsigned long length,
+                  struct http_validator *v) {
+    struct http_conn *hc = &http_conns[conn];
+
+    if (length == HTTP_NO_LENGTH) {
+        hc->keep_alive = 0;
+    }
+    tcp_write_str(conn, "HTTP/1.1 ");
+    tcp_write_str(conn, status);
+    if (mime != NULL) {
+        tcp_write_str(conn, "\r\nContent-Type: ");
+        tcp_write_str(conn, mime);
+    }
+    if (length != HTTP_NO_LENGTH) {
+        tcp_write_str(conn, "\r\nContent-Length: ");
+        tcp_write_ulong(conn, length);
+    }
+    if (v != NULL) {
+        http_validator_headers(conn, v);
+    }
+    http_end_headers(conn);
+}
+
+/* The response is all written: send it and wait for the next request,
+   or close with the FIN on its last segment */
+void http_done(unsigned char conn) {
+    struct http_conn *hc = &http_conns[conn];
+
+    if (hc->keep_alive && tcp_conns[conn].state == TCP_STATE_ESTABLISHED) {
+        tcp_flush(conn);
+        hc->idle = 1;
+        hc->req_time = get_tick_count();
+        tcp_set_idle(conn, 1);
+    } else {
+        tcp_close(conn);
+    }
+}
+
+/* A complete response with an optional HTML body */
+void http_reply(unsigned char conn, char *status, char *body) {
+    if (body != NULL) {
+        http_headers(conn, status, mime_html, strlen(body), NULL);
+        tcp_write_str(conn, body);
+    } else {
+        http_headers(conn, status, NULL, 0, NULL);
+    }
+    http_done(conn);
+}
+
+/* Tell the client to use its cached copy. There's no body, so the
+   connection can be kept open even if the full response couldn't. */
+void http_not_modified(unsigned char conn, struct http_validator *v) {
+    tcp_write_str(conn, "HTTP/1.1 ");
+    tcp_write_str(conn, http_304);
+    http_validator_headers(conn, v);
+    http_end_headers(conn);
+    http_done(conn);
+}
+
+/* Start a file as HTTP response; http_send_files sends the body */
+void send_file(unsigned char conn, char *filename) {
+    struct find_t fileinfo;
+    struct http_validator v;
     int fh;
     char *mime;
-    unsigned int bytes_read;
+
+    if (_dos_findfirst(filename, _A_NORMAL, &fileinfo) != 0) {
+        http_reply(conn, http_404, http_404_body);
+        return;
+    }
+
+    make_validator(&v, fileinfo.size,
+                   ((unsigned long)fileinfo.wr_date << 16) | fileinfo.wr_time);
+    if (not_modified(conn, &v)) {
+        http_not_modified(conn, &v);
+        return;
+    }
 
     if (_dos_open(filename, 0, &fh) != 0) {
-        tcp_send((unsigned char *)http_404, sizeof(http_404) - 1);
-        tcp_close();
+        http_reply(conn, http_404, http_404_body);
         return;
     }
 
     mime = get_mime_type(filename);
 
-    tcp_send((unsigned char *)http_200, sizeof(http_200) - 1);
-    tcp_send((unsigned char *)mime, strlen(mime));
-    tcp_send((unsigned char *)http_crlf, sizeof(http_crlf) - 1);
-
-    while (_dos_read(fh, file_buf, sizeof(file_buf), &bytes_read) == 0 && bytes_read > 0) {
-        tcp_send(file_buf, (unsigned char)bytes_read);
+    /* The headers go out in front of the first part of the file */
+    http_headers(conn, http_200, mime, fileinfo.size, &v);
+    if (fileinfo.size == 0) {
+        _dos_close(fh);
+        http_done(conn);
+        return;
     }
-
-    _dos_close(fh);
-    tcp_close();
+    http_conns[conn].send_file = fh;
+    http_conns[conn].send_left = fileinfo.size;
 }
 
-/* Send unsigned long as ASCII over TCP */
-void tcp_send_ulong(unsigned long n) {
-    char buf[11];
-    unsigned char i = 0;
-    if (n == 0) { tcp_send((unsigned char *)"0", 1); return; }
-    while (n > 0) { buf[i++] = '0' + (unsigned char)(n % 10); n /= 10; }
-    while (i > 0) { --i; tcp_send((unsigned char *)&buf[i], 1); }
+/* Move open files into their connections' send queues, a segment from
+   each in turn so that concurrent responses share the link. Each is read
+   straight into the queue, and the last segment carries the FIN unless
+   the connection is kept open. */
+void http_send_files(void) {
+    unsigned char conn;
+    unsigned int bytes_read, n;
+    struct http_conn *hc;
+
+    for (conn = 0; conn < TCP_MAX_CONNS; conn++) {
+        hc = &http_conns[conn];
+        if (hc->send_file == -1 || !tcp_tx_ready(conn)) {
+            continue;
+        }
+        n = tcp_conns[conn].snd_mss - tcp_conns[conn].write_len;
+        if (hc->send_left < n) {
+            n = (unsigned int)hc->send_left;
+        }
+        if (_dos_read(hc->send_file, tcp_tx_buffer(conn), n, &bytes_read) == 0 &&
+            bytes_read > 0) {
+            hc->send_left -= bytes_read;
+            if (hc->send_left == 0) {
+                _dos_close(hc->send_file);
+                hc->send_file = -1;
+                if (hc->keep_alive) {
+                    tcp_send_payload(conn, bytes_read);
+                    http_done(conn);
+                } else {
+                    tcp_send_last(conn, bytes_read);
+                }
+            } else {
+                tcp_send_payload(conn, bytes_read);
+            }
+        } else {
+            /* Shorter than when it was opened */
+            _dos_close(hc->send_file);
+            hc->send_file = -1;
+            tcp_close(conn);
+        }
+    }
 }
 
-/* Send directory listing as HTTP response */
-void send_directory(char *dirname, char *url_path) {
+/* Validator for a directory listing. DOS doesn't update a directory's
+   own date when its entries change, so it is checked against a checksum
+   of the names, sizes and dates listed and the newest of those dates. */
+void dir_validator(char *searchpath, struct http_validator *v) {
     struct find_t fileinfo;
-    char searchpath[80];
-    char *name;
+    unsigned long sum = 0;
+    unsigned long newest = 0;
+    unsigned long stamp;
+    char *p;
 
-    /* Send HTTP header */
-    tcp_send((unsigned char *)http_200, sizeof(http_200) - 1);
-    tcp_send((unsigned char *)mime_html, sizeof(mime_html) - 1);
-    tcp_send((unsigned char *)http_crlf, sizeof(http_crlf) - 1);
+    if (_dos_findfirst(searchpath, _A_NORMAL | _A_SUBDIR, &fileinfo) == 0) {
+        do {
+            if (fileinfo.name[0] == '.') {
+                continue;
+            }
+            stamp = ((unsigned long)fileinfo.wr_date << 16) | fileinfo.wr_time;
+            if (stamp > newest) {
+                newest = stamp;
+            }
+            for (p = fileinfo.name; *p; p++) {
+                sum = (sum << 5) + sum + (unsigned char)*p;
+            }
+            sum = (sum << 5) + sum + fileinfo.size + stamp;
+        } while (_dos_findnext(&fileinfo) == 0);
+    }
 
-    /* Send HTML header */
-    tcp_send((unsigned char *)dir_header, sizeof(dir_header) - 1);
-    tcp_send((unsigned char *)url_path, strlen(url_path));
-    tcp_send((unsigned char *)dir_mid, sizeof(dir_mid) - 1);
+    make_validator(v, sum, newest);
+}
 
-    /* Parent directory link (if not root) */
-    if (strcmp(url_path, "/") != 0) {
-        tcp_send((unsigned char *)dir_parent, sizeof(dir_parent) - 1);
-    }
+/* Send directory listing as HTTP response, packed into full segments */
+void send_directory(unsigned char conn, char *dirname, char *url_path) {
+    struct find_t fileinfo;
+    struct http_validator v;
+    char searchpath[80];
+    char *name;
 
     /* Build search path */
     if (strcmp(dirname, ".") == 0) {
@@ -243,6 +538,25 @@ void send_directory(char *dirname, char *url_path) {
         strcat(searchpath, "\\*.*");
     }
 
+    dir_validator(searchpath, &v);
+    if (not_modified(conn, &v)) {
+        http_not_modified(conn, &v);
+        return;
+    }
+
+    /* Send HTTP header; the length isn't known until the end */
+    http_headers(conn, http_200, mime_html, HTTP_NO_LENGTH, &v);
+
+    /* Send HTML header */
+    tcp_write(conn, (unsigned char *)dir_header, sizeof(dir_header) - 1);
+    tcp_write_str(conn, url_path);
+    tcp_write(conn, (unsigned char *)dir_mid, sizeof(dir_mid) - 1);
+
+    /* Parent directory link (if not root) */
+    if (strcmp(url_path, "/") != 0) {
+        tcp_write(conn, (unsigned char *)dir_parent, sizeof(dir_parent) - 1);
+    }
+
     /* Find files */
     if (_dos_findfirst(searchpath, _A_NORMAL | _A_SUBDIR, &fileinfo) == 0) {
         do {
@@ -252,46 +566,48 @@ void send_directory(char *dirname, char *url_path) {
             }
 
             name = fileinfo.name;
-            tcp_send((unsigned char *)"<a href=\"", 9);
-            tcp_send((unsigned char *)name, strlen(name));
+            tcp_write_str(conn, "<a href=\"");
+            tcp_write_str(conn, name);
             if (fileinfo.attrib & _A_SUBDIR) {
-                tcp_send((unsigned char *)"/\">", 3);
-                tcp_send((unsigned char *)name, strlen(name));
-                tcp_send((unsigned char *)"/</a>\t\t(dir)\n", 13);
+                tcp_write_str(conn, "/\">");
+                tcp_write_str(conn, name);
+                tcp_write_str(conn, "/</a>\t\t(dir)\n");
             } else {
-                tcp_send((unsigned char *)"\">", 2);
-                tcp_send((unsigned char *)name, strlen(name));
-                tcp_send((unsigned char *)"</a>\t\t", 6);
-                tcp_send_ulong(fileinfo.size);
-                tcp_send((unsigned char *)"\n", 1);
+                tcp_write_str(conn, "\">");
+                tcp_write_str(conn, name);
+                tcp_write_str(conn, "</a>\t\t");
+                tcp_write_ulong(conn, fileinfo.size);
+                tcp_write_str(conn, "\n");
             }
         } while (_dos_findnext(&fileinfo) == 0);
     }
 
     /* Send HTML footer */
-    tcp_send((unsigned char *)dir_footer, sizeof(dir_footer) - 1);
-    tcp_close();
+    tcp_write(conn, (unsigned char *)dir_footer, sizeof(dir_footer) - 1);
+    http_done(conn);
 }
 
 /* Handle PUT upload */
-void handle_put(char *url_path) {
+void handle_put(unsigned char conn, char *url_path) {
+    struct http_conn *hc = &http_conns[conn];
     char filename[64];
 
     url_to_filename(url_path, filename, sizeof(filename));
 
-    if (_dos_creat(filename, 0, &put_file) != 0) {
-        tcp_send((unsigned char *)http_404, sizeof(http_404) - 1);
-        tcp_close();
-        put_in_progress = 0;
+    if (_dos_creat(filename, 0, &hc->put_file) != 0) {
+        hc->keep_alive = 0;  /* The body would be taken for a request */
+        http_reply(conn, http_404, http_404_body);
+        hc->put_file = -1;
+        hc->put_in_progress = 0;
         return;
     }
 
-    put_in_progress = 1;
-    put_bytes_received = 0;
+    hc->put_in_progress = 1;
+    hc->put_bytes_received = 0;
 }
 
 /* Handle a request - file or directory */
-void handle_request(char *url_path) {
+void handle_request(unsigned char conn, char *url_path) {
     char filename[64];
     char indexpath[80];
     int fh;
@@ -311,128 +627,155 @@ void handle_request(char *url_path) {
         /* Check if index.htm exists */
         if (_dos_open(indexpath, 0, &fh) == 0) {
             _dos_close(fh);
-            send_file(indexpath);
+            send_file(conn, indexpath);
         } else {
             /* Send directory listing */
-            send_directory(filename, url_path);
+            send_directory(conn, filename, url_path);
         }
     } else {
         /* Regular file */
-        send_file(filename);
+        send_file(conn, filename);
     }
 }
 
-/* HTTP request buffer */
-unsigned char http_req[1024];
-unsigned short http_req_len = 0;
-
 /* Path buffer */
 char url_path[64];
 
-/* Process incoming HTTP data */
-void http_process(unsigned char *data, unsigned short len) {
-    unsigned short i;
-    unsigned char method;
-    char *body_start;
-    unsigned short header_len;
-    unsigned short body_len;
+/* Write upload data to the file, stopping at the Content-Length, and
+   answer once the body is all there. Returns how much of the data was
+   body; anything after it is the client's next request. */
+unsigned short http_put_data(unsigned char conn, unsigned char *data, unsigned short len) {
+    struct http_conn *hc = &http_conns[conn];
     unsigned int nwritten;
-    char success_msg[] = "HTTP/1.0 201 Created\r\n\r\n";
-
-    /* If PUT upload in progress, write data directly to file */
-    if (put_in_progress) {
-        _dos_write(put_file, data, len, &nwritten);
-        put_bytes_received += nwritten;
-
-        if (put_bytes_received >= put_content_length) {
-            /* Upload complete */
-            _dos_close(put_file);
-            put_file = -1;
-            tcp_send((unsigned char *)success_msg, sizeof(success_msg) - 1);
-            tcp_close();
-            put_in_progress = 0;
-            http_req_len = 0;
-        }
-        return;
-    }
 
-    /* Accumulate request headers */
-    for (i = 0; i < len && http_req_len < sizeof(http_req) - 1; i++) {
-        http_req[http_req_len++] = data[i];
+    if (len > hc->put_content_length - hc->put_bytes_received) {
+        len = (unsigned short)(hc->put_content_length - hc->put_bytes_received);
+    }
+    _dos_write(hc->put_file, data, len, &nwritten);
+    hc->put_bytes_received += len;
+
+    if (hc->put_bytes_received >= hc->put_content_length) {
+        /* Upload complete */
+        _dos_close(hc->put_file);
+        hc->put_file = -1;
+        hc->put_in_progress = 0;
+        http_reply(conn, http_201, NULL);
     }
-    http_req[http_req_len] = '\0';
+    return len;
+}
 
-    /* Check for complete headers (blank line) */
-    if (http_req_len >= 4 &&
-        http_req[http_req_len - 4] == '\r' &&
-        http_req[http_req_len - 3] == '\n' &&
-        http_req[http_req_len - 2] == '\r' &&
-        http_req[http_req_len - 1] == '\n') {
+/* Handle a request whose headers are all in the buffer */
+void http_request(unsigned char conn) {
+    struct http_conn *hc = &http_conns[conn];
+    unsigned char method;
+
+    http_requests++;
+
+    method = parse_request((char *)hc->req, url_path, sizeof(url_path));
+    hc->keep_alive = parse_keep_alive((char *)hc->req);
+
+    if (method == 1) {
+        /* GET request */
+        putch('#'); print_uint(http_requests); print_str(" GET "); print_str(url_path); putch('\r'); putch('\n');
+        handle_request(conn, url_path);
+    } else if (method == 2) {
+        /* PUT request */
+        putch('#'); print_uint(http_requests); print_str(" PUT "); print_str(url_path); putch('\r'); putch('\n');
+        if (!allow_put) {
+            hc->keep_alive = 0;  /* The body would be taken for a request */
+            http_reply(conn, http_405, NULL);
+            return;
+        }
+        hc->put_content_length = parse_content_length((char *)hc->req);
 
-        http_requests++;
+        if (hc->put_content_length == 0) {
+            /* No content or no Content-Length header */
+            hc->keep_alive = 0;
+            http_reply(conn, http_404, http_404_body);
+            return;
+        }
 
-        method = parse_request((char *)http_req, url_path, sizeof(url_path));
+        /* The body follows in http_process */
+        handle_put(conn, url_path);
+    } else {
+        putch('#'); print_uint(http_requests); print_str(" Bad request\r\n");
+        hc->keep_alive = 0;
+        http_reply(conn, http_404, http_404_body);
+    }
+}
 
-        if (method == 1) {
-            /* GET request */
-            putch('#'); print_uint(http_requests); print_str(" GET "); print_str(url_path); putch('\r'); putch('\n');
-            handle_request(url_path);
-            http_req_len = 0;
-        } else if (method == 2) {
-            /* PUT request */
-            putch('#'); print_uint(http_requests); print_str(" PUT "); print_str(url_path); putch('\r'); putch('\n');
-            if (!allow_put) {
-                tcp_send((unsigned char *)http_405, sizeof(http_405) - 1);
-                tcp_close();
-                http_req_len = 0;
-                return;
-            }
-            put_content_length = parse_content_length((char *)http_req);
+/* Process incoming HTTP data. Headers are taken up to the blank line
+   that ends them, so a PUT body or a pipelined request that arrives
+   with them is left for what comes next. */
+void http_process(unsigned char conn, unsigned char *data, unsigned short len) {
+    struct http_conn *hc = &http_conns[conn];
+    unsigned short n;
+    unsigned char c;
+
+    while (len > 0) {
+        /* If PUT upload in progress, write data directly to file */
+        if (hc->put_in_progress) {
+            n = http_put_data(conn, data, len);
+            data += n;
+            len -= n;
+            continue;
+        }
 
-            if (put_content_length == 0) {
-                /* No content or no Content-Length header */
-                tcp_send((unsigned char *)http_404, sizeof(http_404) - 1);
-                tcp_close();
-                http_req_len = 0;
-                return;
-            }
+        /* Requests sent before the last response is complete aren't taken;
+           the connection closes after it and the client asks again */
+        if (hc->send_file != -1) {
+            hc->keep_alive = 0;
+            return;
+        }
 
-            handle_put(url_path);
+        /* Accumulate request headers */
+        if (hc->req_len == 0) {
+            hc->req_time = get_tick_count();
+            hc->idle = 0;
+            tcp_set_idle(conn, 0);
+        }
+        c = *data++;
+        len--;
+        if (hc->req_len < sizeof(hc->req) - 1) {
+            hc->req[hc->req_len++] = c;
+        }
 
-            if (!put_in_progress) {
-                /* Failed to open file */
-                http_req_len = 0;
+        /* Check for complete headers (blank line) */
+        if (c == '\n' && hc->req_len >= 4 &&
+            hc->req[hc->req_len - 4] == '\r' &&
+            hc->req[hc->req_len - 3] == '\n' &&
+            hc->req[hc->req_len - 2] == '\r') {
+            hc->req[hc->req_len] = '\0';
+            http_request(conn);
+            hc->req_len = 0;
+
+            /* Nothing more is read from a connection being closed */
+            if (!hc->keep_alive || tcp_conns[conn].state != TCP_STATE_ESTABLISHED) {
                 return;
             }
+        }
+    }
+}
 
-            /* Check if any body data already received with headers */
-            body_start = strstr((char *)http_req, "\r\n\r\n");
-            if (body_start != NULL) {
-                body_start += 4; /* Skip the blank line */
-                header_len = (unsigned short)(body_start - (char *)http_req);
-                body_len = http_req_len - header_len;
-
-                if (body_len > 0) {
-                    _dos_write(put_file, (unsigned char *)body_start, body_len, &nwritten);
-                    put_bytes_received += nwritten;
-
-                    if (put_bytes_received >= put_content_length) {
-                        /* Upload already complete */
-                        _dos_close(put_file);
-                        put_file = -1;
-                        tcp_send((unsigned char *)success_msg, sizeof(success_msg) - 1);
-                        tcp_close();
-                        put_in_progress = 0;
-                    }
-                }
-            }
-
-            http_req_len = 0;
-        } else {
-            putch('#'); print_uint(http_requests); print_str(" Bad request\r\n");
-            tcp_send((unsigned char *)http_404, sizeof(http_404) - 1);
-            tcp_close();
-            http_req_len = 0;
+/* Reset connections whose request headers have stopped short. The
+   stack's idle timer can't tell a client trickling them in from one
+   that is making progress. Connections kept open are closed once idle
+   for a while, or at once if another client is waiting for the slot. */
+void http_check_requests(void) {
+    unsigned char conn;
+    struct http_conn *hc;
+
+    for (conn = 0; conn < TCP_MAX_CONNS; conn++) {
+        hc = &http_conns[conn];
+        if (hc->req_len > 0 && !hc->put_in_progress &&
+            (get_tick_count() - hc->req_time) >= HTTP_REQUEST_TIMEOUT) {
+            print_str("[Request timeout]\r\n");
+            http_timeouts++;
+            tcp_abort(conn);
+        } else if (hc->idle && (conn_queue_count > 0 ||
+                   (get_tick_count() - hc->req_time) >= HTTP_KEEPALIVE_TIMEOUT)) {
+            hc->idle = 0;
+            tcp_close(conn);
         }
     }
 }
@@ -441,27 +784,38 @@ void http_process(unsigned char *data, unsigned short len) {
  * Network Callbacks
  *============================================================================*/
 
-void app_tcp_data_received(unsigned char *data, unsigned short len) {
-    http_process(data, len);
+void app_tcp_data_received(unsigned char conn, unsigned char *data, unsigned short len) {
+    http_process(conn, data, len);
 }
 
-void app_tcp_state_changed(unsigned char old_state, unsigned char new_state,
+void app_tcp_state_changed(unsigned char conn, unsigned char old_state,
+                           unsigned char new_state,
                            unsigned long remote_ip, unsigned short remote_port) {
+    struct http_conn *hc = &http_conns[conn];
+
     (void)old_state;
     (void)remote_ip;
     (void)remote_port;
 
-    if (new_state == TCP_STATE_LISTEN) {
-        http_req_len = 0;
+    /* The client is done sending; close once any response has gone */
+    if (new_state == TCP_STATE_CLOSE_WAIT && hc->send_file == -1) {
+        tcp_close(conn);
+    }
 
-        /* Clean up incomplete PUT upload */
-        if (put_in_progress) {
-            if (put_file != -1) {
-                _dos_close(put_file);
-                put_file = -1;
-            }
-            put_in_progress = 0;
+    if (new_state == TCP_STATE_CLOSED) {
+        hc->req_len = 0;
+        hc->idle = 0;
+
+        /* Clean up an unfinished response or PUT upload */
+        if (hc->send_file != -1) {
+            _dos_close(hc->send_file);
+            hc->send_file = -1;
+        }
+        if (hc->put_file != -1) {
+            _dos_close(hc->put_file);
+            hc->put_file = -1;
         }
+        hc->put_in_progress = 0;
     }
 }
 
@@ -475,22 +829,92 @@ unsigned char app_tcp_accept(unsigned long remote_ip, unsigned short remote_port
  * Main
  *============================================================================*/
 
+/* Print link statistics to the console */
+void print_stats(void) {
+    unsigned char i;
+
+    print_str("Requests: "); print_uint(http_requests);
+    print_str(", timed out: "); print_uint(http_timeouts);
+    print_str(", idle connections reset: "); print_uint(tcp_idle_resets); putch('\r'); putch('\n');
+    print_str("Serial: "); print_ulong(DIVISOR_BAUD(serial_divisor));
+    print_str(uart_fifo ? " baud, FIFO" : " baud, no FIFO");
+    print_str(flow_control ? ", RTS/CTS\r\n" : "\r\n");
+    print_str("RX overflows: "); print_uint(rx_overflows);
+    print_str(" overruns: "); print_uint(uart_overruns);
+    print_str(" framing: "); print_uint(uart_frame_errors); putch('\r'); putch('\n');
+    print_str("TCP sent: "); print_ulong(tcp_bytes_sent);
+    print_str(" bytes, copied: "); print_ulong(tcp_bytes_copied);
+    print_str(", retransmits: "); print_uint(tcp_retransmits);
+    print_str(" (fast "); print_uint(tcp_fast_retransmits); putch(')');
+    print_str(", window probes: "); print_uint(tcp_window_probes);
+    print_str(", updates: "); print_uint(tcp_window_updates); putch('\r'); putch('\n');
+    for (i = 0; i < TCP_MAX_CONNS; i++) {
+        if (tcp_conns[i].srtt) {
+            print_str("TCP "); print_uint(i);
+            print_str(" RTT: "); print_ulong((unsigned long)tcp_conns[i].srtt * 55 / 8);
+            print_str(" ms, timeout: "); print_ulong((unsigned long)tcp_conns[i].rto * 55);
+            print_str(" ms\r\n");
+        }
+    }
+    print_str("TCP fast path: "); print_uint(tcp_fast_acks);
+    print_str(" ACKs, "); print_uint(tcp_fast_data);
+    print_str(" data, slow path: "); print_uint(tcp_slow_path); putch('\r'); putch('\n');
+    print_str("TCP received again: "); print_uint(tcp_rx_dups);
+    print_str(", out of order: "); print_uint(tcp_rx_ooo); putch('\r'); putch('\n');
+    print_str("Delayed ACKs: "); print_uint(tcp_acks_piggybacked);
+    print_str(" sent with data, "); print_uint(tcp_acks_delayed);
+    print_str(" on timeout\r\n");
+    if (cslip_enabled) {
+        print_str("CSLIP compressed TX: "); print_uint(vj_tx_compressed);
+        print_str(" RX: "); print_uint(vj_rx_compressed);
+        print_str(" errors: "); print_uint(vj_rx_errors); putch('\r'); putch('\n');
+    }
+}
+
+/* Parse a decimal number, returns 0 if it isn't one */
+unsigned long parse_ulong(char *s) {
+    unsigned long n = 0;
+
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return (*s == '\0') ? n : 0;
+}
+
 int main(int argc, char *argv[]) {
     int key;
     int i;
     int posarg = 0;
+    unsigned long baud = 9600;
+    unsigned char autobaud = 0;
 
     /* Parse arguments - scan for flags and positional args */
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-w") == 0) {
             allow_put = 1;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            autobaud = 1;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            flow_control = 1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            cslip_enabled = 1;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            tcp_early_synack = 1;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baud = parse_ulong(argv[++i]);
+            if (baud == 0 || baud > 115200UL || 115200UL % baud != 0) {
+                print_str("Invalid baud rate: "); print_str(argv[i]); putch('\r'); putch('\n');
+                print_str("Usage: httpofo [ip] [path] [-w] [-b baud] [-a] [-f] [-c] [-e]\r\n");
+                return 1;
+            }
         } else {
             posarg++;
             if (posarg == 1) {
                 local_ip = parse_ip(argv[i]);
                 if (local_ip == 0) {
                     print_str("Invalid IP: "); print_str(argv[i]); putch('\r'); putch('\n');
-                    print_str("Usage: httpofo [ip] [path] [-w]\r\n");
+                    print_str("Usage: httpofo [ip] [path] [-w] [-b baud] [-a] [-f] [-c] [-e]\r\n");
                     return 1;
                 }
             } else if (posarg == 2) {
@@ -505,34 +929,51 @@ int main(int argc, char *argv[]) {
     putch(':'); print_uint(HTTP_PORT); putch('\r'); putch('\n');
     print_str("Serving from "); print_str(doc_root); putch('\r'); putch('\n');
     if (allow_put) print_str("PUT enabled\r\n");
-    print_str("Ctrl+Q to quit\r\n\r\n");
+    if (cslip_enabled) print_str("CSLIP header compression\r\n");
+    print_str("S for stats, Ctrl+Q to quit\r\n\r\n");
 
-    init_serial();
+    init_serial(BAUD_DIVISOR(baud));
+
+    if (autobaud) {
+        /* Probe the host at x.x.x.1 on our subnet */
+        print_str("Negotiating baud rate...\r\n");
+        if (!slip_autobaud((local_ip & 0xFFFFFF00UL) | 1)) {
+            print_str("No reply from host, ");
+        }
+    }
+    print_str("Serial at "); print_ulong(DIVISOR_BAUD(serial_divisor));
+    print_str(" baud\r\n");
 
+    for (i = 0; i < TCP_MAX_CONNS; i++) {
+        http_conns[i].send_file = -1;
+        http_conns[i].put_file = -1;
+    }
     tcp_listen(HTTP_PORT);
 
     for (;;) {
-        if (slip_poll()) {
-            ip_receive(pkt_buf, pkt_len);
-            pkt_len = 0;
-        }
-
-        tcp_check_retransmit();
+        net_poll();
+        http_send_files();
+        http_check_requests();
 
         if (kbhit()) {
             key = getch();
 
             if (key == 0x11) {
-                if (tcp_state == TCP_STATE_ESTABLISHED) {
-                    tcp_close();
+                for (i = 0; i < TCP_MAX_CONNS; i++) {
+                    tcp_close(i);
                 }
                 break;
             }
+            if (key == 's' || key == 'S') {
+                print_stats();
+            }
         }
     }
 
     cleanup_serial();
-    print_str("\r\nBye!\r\n");
+    print_str("\r\n");
+    print_stats();
+    print_str("Bye!\r\n");
 
     return 0;
 }
@@ -3,167 +3,81 @@
 #include <conio.h>
 #include <string.h>
 #include "network.h"
-
-/*============================================================================
- * UART Definitions
- *============================================================================*/
-
-#define RBR 0  /* Receiver Buffer Register (read) */
-#define THR 0  /* Transmitter Holding Register (write) */
-#define IER 1  /* Interrupt Enable Register */
-#define IIR 2  /* Interrupt Identification Register */
-#define LCR 3  /* Line Control Register */
-#define MCR 4  /* Modem Control Register */
-#define LSR 5  /* Line Status Register */
-#define MSR 6  /* Modem Status Register */
-
-#define LSR_DATA_READY    0x01
-#define LSR_THRE          0x20
-#define IER_RX_DATA       0x01
-#define SIVR_PORT         0x807F
-#define SERIAL_INT_VECTOR 0x60
+#include "platform.h"
 
 /*============================================================================
  * Serial Layer
  *============================================================================*/
 
+/* Receive ring - filled by the platform layer, drained by slip_poll */
 volatile unsigned char rx_buf[RX_BUF_SIZE];
-volatile unsigned char rx_head = 0;
-volatile unsigned char rx_tail = 0;
+volatile unsigned short rx_head = 0;
+volatile unsigned short rx_tail = 0;
+volatile unsigned char rx_throttled = 0;  /* Peer told to pause (RTS low) */
 
-unsigned short uart_base = 0;
-void (__interrupt __far *old_serial_handler)() = 0;
+/* Transmit queue - filled by slip_queue, drained by the platform layer */
+volatile unsigned char tx_queue[TX_QUEUE_SIZE];
+volatile unsigned short tx_head = 0;
+volatile unsigned short tx_tail = 0;
 
-unsigned short get_uart_base(void) {
-    unsigned short base = 0;
-    __asm {
-        push es
-        mov ax, 0x0040
-        mov es, ax
-        xor bx, bx
-        mov ax, es:[bx]
-        mov base, ax
-        pop es
-    }
-    return base;
-}
+/* Line configuration */
+unsigned char flow_control = 0;        /* RTS/CTS hardware handshaking */
 
-unsigned char read_uart(unsigned char reg) {
-    unsigned char value = 0;
-    unsigned short addr = uart_base + reg;
-    __asm {
-        mov dx, addr
-        in al, dx
-        mov value, al
-    }
-    return value;
-}
-
-void write_uart(unsigned char reg, unsigned char value) {
-    unsigned short addr = uart_base + reg;
-    __asm {
-        mov dx, addr
-        mov al, value
-        out dx, al
-    }
-}
-
-void __interrupt __far serial_interrupt_handler(void) {
-    unsigned char lsr, c, next_head;
-    (void)read_uart(IIR);
-    lsr = read_uart(LSR);
-    while (lsr & LSR_DATA_READY) {
-        c = read_uart(RBR);
-        next_head = (rx_head + 1) % RX_BUF_SIZE;
-        if (next_head != rx_tail) {
-            rx_buf[rx_head] = c;
-            rx_head = next_head;
-        }
-        lsr = read_uart(LSR);
-    }
-}
+/* Error counters */
+volatile unsigned short rx_overflows = 0;      /* Ring full, byte dropped */
+volatile unsigned short uart_overruns = 0;     /* LSR overrun */
+volatile unsigned short uart_frame_errors = 0; /* LSR framing or parity */
 
 unsigned char rx_available(void) {
+    if (rx_head == rx_tail) {
+        serial_poll();
+    }
     return (rx_head != rx_tail);
 }
 
 unsigned char rx_getchar(void) {
     unsigned char c;
     c = rx_buf[rx_tail];
-    rx_tail = (rx_tail + 1) % RX_BUF_SIZE;
-    return c;
-}
-
-void tx_putchar(unsigned char c) {
-    while (!(read_uart(LSR) & LSR_THRE));
-    write_uart(THR, c);
-}
+    rx_tail = (rx_tail + 1) & RX_BUF_MASK;
 
-void (__interrupt __far *get_vector(unsigned char intnum))() {
-    void __far *handler = 0;
-    __asm {
-        mov ah, 0x35
-        mov al, intnum
-        int 0x21
-        mov word ptr handler, bx
-        mov word ptr handler+2, es
+    /* Let the peer resume once the ring has drained */
+    if (rx_throttled && ((rx_head - rx_tail) & RX_BUF_MASK) <= RX_LOW_WATER) {
+        rx_unthrottle();
     }
-    return (void (__interrupt __far *)())handler;
+    return c;
 }
 
-void set_vector(unsigned char intnum, void (__interrupt __far *handler)()) {
-    __asm {
-        push ds
-        mov ah, 0x25
-        mov al, intnum
-        lds dx, dword ptr handler
-        int 0x21
-        pop ds
-    }
+/* Free space in the transmit queue (one slot is kept empty) */
+unsigned short tx_free(void) {
+    return (tx_tail - tx_head - 1) & TX_QUEUE_MASK;
 }
 
-void init_int61(void) {
-    __asm {
-        mov ah, 0x00
-        int 0x61
+void tx_putchar(unsigned char c) {
+    while (tx_free() == 0) {
+        serial_poll();
     }
+    tx_queue[tx_head] = c;
+    tx_head = (tx_head + 1) & TX_QUEUE_MASK;
+    tx_kick();
 }
 
-void write_sivr(unsigned char vector) {
-    __asm {
-        mov ah, 0x1C
-        mov al, 0
-        mov bh, 5
-        mov bl, vector
-        mov dx, SIVR_PORT
-        int 0x61
-    }
-}
+#define TX_FLUSH_TIMEOUT 36  /* ticks (~2s) without progress before giving up */
 
-void init_serial(void) {
-    uart_base = get_uart_base();
-    write_uart(IER, 0x00);
-    write_uart(LCR, 0x80);
-    write_uart(0, 12);
-    write_uart(1, 0);
-    write_uart(LCR, 0x03);
-    write_uart(MCR, 0x03);
-    read_uart(LSR);
-    read_uart(RBR);
-    read_uart(IIR);
-    read_uart(MSR);
-    old_serial_handler = get_vector(SERIAL_INT_VECTOR);
-    set_vector(SERIAL_INT_VECTOR, serial_interrupt_handler);
-    init_int61();
-    __asm { sti }
-    write_sivr(SERIAL_INT_VECTOR);
-    write_uart(IER, IER_RX_DATA);
-}
+/* Wait until everything queued has left the UART */
+void tx_flush(void) {
+    unsigned short tail = tx_tail;
+    unsigned long start = get_tick_count();
 
-void cleanup_serial(void) {
-    write_uart(IER, 0x00);
-    write_sivr(0);
-    set_vector(SERIAL_INT_VECTOR, old_serial_handler);
+    while (tx_head != tx_tail) {
+        serial_poll();
+        if (tx_tail != tail) {
+            tail = tx_tail;
+            start = get_tick_count();
+        } else if ((get_tick_count() - start) >= TX_FLUSH_TIMEOUT) {
+            return;  /* Held off by CTS - don't hang on exit */
+        }
+    }
+    while (!tx_idle());
 }
 
 /*============================================================================
@@ -172,12 +86,31 @@ void cleanup_serial(void) {
 
 unsigned long local_ip = 0xC0A80164UL;  /* Default: 192.168.1.100 */
 
+/* Frames are decoded into one buffer while the other may still be in
+   use: the application can wait on the network from inside ip_receive,
+   and what it was handed has to stay put meanwhile */
 unsigned char pkt_buf[PKT_BUF_SIZE];
+unsigned char pkt_alt[PKT_BUF_SIZE];
+unsigned char *slip_frame = pkt_buf;  /* Where the next frame goes */
 unsigned short pkt_len = 0;
 unsigned char slip_escaped = 0;
+unsigned char slip_overflow = 0;     /* Frame was longer than pkt_buf */
+unsigned short slip_err_mark = 0;    /* Line error count at last frame end */
+
+void vj_toss(void);
+
+/* Append a decoded byte to the frame being received */
+#define SLIP_STORE(c) { \
+    if (pkt_len < PKT_BUF_SIZE) { \
+        slip_frame[pkt_len++] = (c); \
+    } else { \
+        slip_overflow = 1; \
+    } \
+}
 
 unsigned char slip_poll(void) {
     unsigned char c;
+    unsigned short errs;
 
     while (rx_available()) {
         c = rx_getchar();
@@ -189,48 +122,160 @@ unsigned char slip_poll(void) {
             } else if (c == SLIP_ESC_ESC) {
                 c = SLIP_ESC;
             }
-            if (pkt_len < PKT_BUF_SIZE) {
-                pkt_buf[pkt_len++] = c;
-            }
+            SLIP_STORE(c);
         } else if (c == SLIP_END) {
-            if (pkt_len > 0) {
+            /* Drop frames that overflowed or spanned a UART error; with
+               header compression the peer's state is now suspect too */
+            errs = rx_overflows + uart_overruns + uart_frame_errors;
+            if (slip_overflow || errs != slip_err_mark) {
+                slip_err_mark = errs;
+                slip_overflow = 0;
+                pkt_len = 0;
+                vj_toss();
+            } else if (pkt_len > 0) {
                 return 1;
             }
         } else if (c == SLIP_ESC) {
             slip_escaped = 1;
         } else {
-            if (pkt_len < PKT_BUF_SIZE) {
-                pkt_buf[pkt_len++] = c;
-            }
+            SLIP_STORE(c);
         }
     }
     return 0;
 }
 
-void slip_send(unsigned char *data, unsigned char len) {
-    unsigned char i, c;
-    tx_putchar(SLIP_END);
+/* Store c at tx_queue[head] with SLIP escaping, advancing head */
+#define TXQ_PUT(c) { \
+    if ((c) == SLIP_END) { \
+        tx_queue[head] = SLIP_ESC; \
+        head = (head + 1) & TX_QUEUE_MASK; \
+        tx_queue[head] = SLIP_ESC_END; \
+    } else if ((c) == SLIP_ESC) { \
+        tx_queue[head] = SLIP_ESC; \
+        head = (head + 1) & TX_QUEUE_MASK; \
+        tx_queue[head] = SLIP_ESC_ESC; \
+    } else { \
+        tx_queue[head] = (c); \
+    } \
+    head = (head + 1) & TX_QUEUE_MASK; \
+}
+
+#define SLIP_ENC_LEN(c) (((c) == SLIP_END || (c) == SLIP_ESC) ? 2 : 1)
+
+/* Queue a SLIP frame without blocking - returns 0 if there is no room */
+unsigned char slip_queue(unsigned char *data, unsigned short len) {
+    unsigned short i, head;
+    unsigned char c;
+
+    if (tx_free() < SLIP_MAX_FRAME(len)) {
+        serial_poll();
+        return 0;
+    }
+
+    head = tx_head;
+    tx_queue[head] = SLIP_END;
+    head = (head + 1) & TX_QUEUE_MASK;
     for (i = 0; i < len; i++) {
         c = data[i];
-        if (c == SLIP_END) {
-            tx_putchar(SLIP_ESC);
-            tx_putchar(SLIP_ESC_END);
-        } else if (c == SLIP_ESC) {
-            tx_putchar(SLIP_ESC);
-            tx_putchar(SLIP_ESC_ESC);
-        } else {
-            tx_putchar(c);
+        TXQ_PUT(c);
+    }
+    tx_queue[head] = SLIP_END;
+    tx_head = (head + 1) & TX_QUEUE_MASK;  /* Publish the whole frame at once */
+
+    tx_kick();
+    return 1;
+}
+
+/* Queue header + payload as one SLIP frame in a single pass over the
+   payload. If cksum_off is non-zero, the payload is summed while it is
+   escaped, added to sum (which must already cover the pseudo-header and
+   the header with its checksum field zeroed), and the folded result is
+   stored at hdr[cksum_off] before the header itself is queued. The
+   payload is escaped first, leaving room in front for the header.
+   Returns 0 if there is no room. */
+unsigned char slip_queue_packet(unsigned char *hdr, unsigned char hdr_len,
+                                unsigned char *data, unsigned short data_len,
+                                unsigned char cksum_off, unsigned long sum) {
+    unsigned short head, start, src, shift, i;
+    unsigned char c, d;
+
+    if (tx_free() < SLIP_MAX_FRAME(hdr_len + data_len)) {
+        serial_poll();
+        return 0;
+    }
+
+    /* Encoded header size, with the zeroed checksum counted as unescaped */
+    start = tx_head + 1;
+    for (i = 0; i < hdr_len; i++) {
+        start += SLIP_ENC_LEN(hdr[i]);
+    }
+
+    /* Escape and sum the payload in one pass */
+    head = start & TX_QUEUE_MASK;
+    start = head;
+    if (!cksum_off) {
+        for (i = data_len; i > 0; i--) {
+            c = *data++;
+            TXQ_PUT(c);
         }
+    } else {
+        for (i = data_len >> 1; i > 0; i--) {
+            c = *data++;
+            d = *data++;
+            sum += ((unsigned short)c << 8) | d;
+            TXQ_PUT(c);
+            TXQ_PUT(d);
+        }
+        if (data_len & 1) {
+            c = *data;
+            sum += (unsigned short)c << 8;
+            TXQ_PUT(c);
+        }
+
+        put_u16(&hdr[cksum_off], checksum_fold(sum));
+
+        /* Rarely the checksum itself needs escaping - slide the payload up */
+        shift = SLIP_ENC_LEN(hdr[cksum_off]) + SLIP_ENC_LEN(hdr[cksum_off + 1]) - 2;
+        if (shift) {
+            src = head;
+            head = (head + shift) & TX_QUEUE_MASK;
+            i = head;
+            while (src != start) {
+                src = (src - 1) & TX_QUEUE_MASK;
+                i = (i - 1) & TX_QUEUE_MASK;
+                tx_queue[i] = tx_queue[src];
+            }
+        }
+    }
+    tx_queue[head] = SLIP_END;
+    src = (head + 1) & TX_QUEUE_MASK;
+
+    /* Now the header, which ends exactly where the payload begins */
+    head = tx_head;
+    tx_queue[head] = SLIP_END;
+    head = (head + 1) & TX_QUEUE_MASK;
+    for (i = 0; i < hdr_len; i++) {
+        c = hdr[i];
+        TXQ_PUT(c);
     }
-    tx_putchar(SLIP_END);
+    tx_head = src;  /* Publish the whole frame at once */
+
+    tx_kick();
+    return 1;
+}
+
+/* Queue a SLIP frame, waiting for the UART to make room if necessary */
+void slip_send(unsigned char *data, unsigned short len) {
+    while (!slip_queue(data, len));
 }
 
 /*============================================================================
  * Helper Functions
  *============================================================================*/
 
-unsigned short checksum(unsigned char *data, unsigned short len) {
-    unsigned long sum = 0;
+/* Add 16-bit big-endian words of data to a running one's complement sum.
+   Portable version of the platform layer's checksum_add. */
+unsigned long checksum_add_c(unsigned long sum, unsigned char *data, unsigned short len) {
     unsigned short i;
 
     for (i = 0; i + 1 < len; i += 2) {
@@ -239,12 +284,29 @@ unsigned short checksum(unsigned char *data, unsigned short len) {
     if (len & 1) {
         sum += (unsigned short)data[len - 1] << 8;
     }
+    return sum;
+}
+
+/* Fold a running sum to 16 bits and complement it */
+unsigned short checksum_fold(unsigned long sum) {
     while (sum >> 16) {
         sum = (sum & 0xFFFF) + (sum >> 16);
     }
     return (unsigned short)(~sum);
 }
 
+unsigned short checksum(unsigned char *data, unsigned short len) {
+    return checksum_fold(checksum_add(0, data, len));
+}
+
+/* Update a checksum for one 16-bit word changing from old_word to
+   new_word, without re-summing the data (RFC 1624, eqn. 3) */
+unsigned short checksum_adjust(unsigned short cksum, unsigned short old_word,
+                               unsigned short new_word) {
+    return checksum_fold((unsigned long)(unsigned short)~cksum +
+                         (unsigned short)~old_word + new_word);
+}
+
 unsigned long get_u32(unsigned char *p) {
     return ((unsigned long)p[0] << 24) |
            ((unsigned long)p[1] << 16) |
@@ -328,12 +390,17 @@ unsigned long parse_ip(char *s) {
 void icmp_receive(unsigned char *pkt, unsigned short len, unsigned long src_ip);
 void tcp_receive(unsigned char *pkt, unsigned short len, unsigned long src_ip);
 void udp_receive(unsigned char *pkt, unsigned short len, unsigned long src_ip);
+unsigned short vj_uncompress(unsigned char *pkt, unsigned short len);
 
 void ip_receive(unsigned char *pkt, unsigned short len) {
     unsigned char ver_ihl, ihl, protocol;
-    unsigned short total_len, header_checksum, calc_checksum;
+    unsigned short total_len;
     unsigned long src_ip, dst_ip;
 
+    if (cslip_enabled) {
+        len = vj_uncompress(pkt, len);
+    }
+
     if (len < IP_HEADER_LEN) return;
 
     ver_ihl = pkt[IP_VER_IHL];
@@ -345,12 +412,8 @@ void ip_receive(unsigned char *pkt, unsigned short len) {
     total_len = get_u16(&pkt[IP_TOTAL_LEN]);
     if (total_len > len) return;
 
-    header_checksum = get_u16(&pkt[IP_CHECKSUM]);
-    put_u16(&pkt[IP_CHECKSUM], 0);
-    calc_checksum = checksum(pkt, ihl);
-    put_u16(&pkt[IP_CHECKSUM], header_checksum);
-
-    if (calc_checksum != header_checksum) return;
+    /* Summed with its checksum field, a valid header folds to zero */
+    if (checksum(pkt, ihl) != 0) return;
 
     src_ip = get_u32(&pkt[IP_SRC_IP]);
     dst_ip = get_u32(&pkt[IP_DST_IP]);
@@ -369,31 +432,347 @@ void ip_receive(unsigned char *pkt, unsigned short len) {
 }
 
 unsigned short ip_id = 1;
-unsigned char tx_buf[PKT_BUF_SIZE];
+unsigned char ip_hdr[IP_HEADER_LEN];
+
+/* Fill in a complete IP header, including its checksum. The checksum is
+   summed from the field values rather than re-read from the buffer. */
+void ip_build_header(unsigned char *hdr, unsigned long dst_ip,
+                     unsigned char protocol, unsigned short payload_len) {
+    unsigned long sum;
+
+    hdr[IP_VER_IHL] = 0x45;
+    hdr[IP_TOS] = 0;
+    put_u16(&hdr[IP_TOTAL_LEN], IP_HEADER_LEN + payload_len);
+    put_u16(&hdr[IP_ID], ip_id);
+    put_u16(&hdr[IP_FRAG], 0);
+    hdr[IP_TTL] = 64;
+    hdr[IP_PROTO] = protocol;
+    put_u32(&hdr[IP_SRC_IP], local_ip);
+    put_u32(&hdr[IP_DST_IP], dst_ip);
+
+    sum = 0x4500UL + IP_HEADER_LEN + payload_len + ip_id + (64 << 8) + protocol +
+          (local_ip >> 16) + (local_ip & 0xFFFF) + (dst_ip >> 16) + (dst_ip & 0xFFFF);
+    put_u16(&hdr[IP_CHECKSUM], checksum_fold(sum));
+    ip_id++;
+}
 
 void ip_send(unsigned long dst_ip, unsigned char protocol,
-             unsigned char *payload, unsigned char payload_len) {
-    unsigned short total_len;
-    unsigned short cksum;
+             unsigned char *payload, unsigned short payload_len) {
+    ip_build_header(ip_hdr, dst_ip, protocol, payload_len);
+    while (!slip_queue_packet(ip_hdr, IP_HEADER_LEN, payload, payload_len, 0, 0));
+}
+
+/*============================================================================
+ * Header Compression (RFC 1144)
+ *============================================================================*/
+
+/* Frame types, carried in the top bits of the first byte */
+#define VJ_TYPE_UNCOMPRESSED_TCP 0x70
+#define VJ_TYPE_COMPRESSED_TCP   0x80
+
+/* Change mask bits */
+#define VJ_NEW_C     0x40
+#define VJ_NEW_I     0x20
+#define VJ_PUSH      0x10
+#define VJ_NEW_S     0x08
+#define VJ_NEW_A     0x04
+#define VJ_NEW_W     0x02
+#define VJ_NEW_U     0x01
+#define VJ_SPECIALS  0x0F
+#define VJ_SPECIAL_I (VJ_NEW_S | VJ_NEW_W | VJ_NEW_U)
+#define VJ_SPECIAL_D (VJ_NEW_S | VJ_NEW_A | VJ_NEW_W | VJ_NEW_U)
+
+#define VJ_HDR_LEN  (IP_HEADER_LEN + TCP_HEADER_LEN)  /* No IP or TCP options */
+#define VJ_RX_SLOTS 16   /* Linux compresses with 16 slots */
+#define VJ_TX_SLOTS 4
+#define VJ_NO_SLOT  0xFF
+
+/* Last header seen on one connection */
+struct vj_slot {
+    unsigned char  hdr[VJ_HDR_LEN];
+    unsigned char  valid;
+    unsigned short last_used;    /* Transmit side LRU stamp */
+};
+
+unsigned char cslip_enabled = 0;
+
+struct vj_slot vj_rx[VJ_RX_SLOTS];
+struct vj_slot vj_tx[VJ_TX_SLOTS];
+unsigned char vj_rx_current = VJ_NO_SLOT;
+unsigned char vj_tx_current = VJ_NO_SLOT;
+unsigned char vj_tossing = 1;    /* Drop implicit-slot frames until resynced */
+unsigned short vj_clock = 0;
+
+unsigned short vj_tx_compressed = 0;
+unsigned short vj_rx_compressed = 0;
+unsigned short vj_rx_errors = 0;
+
+/* Receive error: discard compressed frames until the peer names a slot */
+void vj_toss(void) {
+    vj_tossing = 1;
+}
+
+unsigned char *vj_encode(unsigned char *cp, unsigned short n) {
+    if (n == 0 || n >= 256) {
+        *cp++ = 0;
+        *cp++ = (unsigned char)(n >> 8);
+    }
+    *cp++ = (unsigned char)n;
+    return cp;
+}
+
+unsigned short vj_decode(unsigned char **cpp) {
+    unsigned char *cp = *cpp;
+    unsigned short n = *cp++;
+
+    if (n == 0) {
+        n = ((unsigned short)cp[0] << 8) | cp[1];
+        cp += 2;
+    }
+    *cpp = cp;
+    return n;
+}
+
+/* Try to compress the IP + TCP header in hdr before it is sent. Returns
+   the length of the compressed header written to out, with *cksum_off set
+   to where the TCP checksum belongs in it. Returns 0 to send hdr as is,
+   having retagged it as an uncompressed-TCP frame if that applies. */
+unsigned char vj_compress(unsigned char *hdr, unsigned char *out,
+                          unsigned char *cksum_off) {
+    unsigned char *th = &hdr[IP_HEADER_LEN];
+    unsigned char *oip, *oth;
+    unsigned char deltas[16];
+    unsigned char *cp, *op;
+    unsigned char changes = 0;
+    unsigned char i, slot;
+    unsigned short delta, old_data_len;
+    unsigned long delta_s, delta_a;
+
+    /* Only plain ACK segments are compressible - the rest go as TYPE_IP */
+    if (hdr[IP_VER_IHL] != 0x45 || (get_u16(&hdr[IP_FRAG]) & 0x3FFF) ||
+        th[TCP_DATA_OFF] != 0x50 ||
+        (th[TCP_FLAGS] & (TCP_SYN | TCP_FIN | TCP_RST | TCP_ACK)) != TCP_ACK) {
+        return 0;
+    }
+
+    /* Find this connection's slot, or recycle the least recently used */
+    slot = 0;
+    for (i = 0; i < VJ_TX_SLOTS; i++) {
+        if (!vj_tx[i].valid) {
+            slot = i;
+            continue;
+        }
+        if (memcmp(&vj_tx[i].hdr[IP_SRC_IP], &hdr[IP_SRC_IP], 8) == 0 &&
+            memcmp(&vj_tx[i].hdr[IP_HEADER_LEN], th, 4) == 0) {
+            break;
+        }
+        if (vj_tx[slot].valid && vj_tx[i].last_used < vj_tx[slot].last_used) {
+            slot = i;
+        }
+    }
+    if (i == VJ_TX_SLOTS) {
+        goto uncompressed;
+    }
+    slot = i;
+    vj_tx[slot].last_used = ++vj_clock;
+
+    oip = vj_tx[slot].hdr;
+    oth = &oip[IP_HEADER_LEN];
+
+    /* Fields RFC 1144 doesn't encode must be unchanged */
+    if (hdr[IP_TOS] != oip[IP_TOS] || hdr[IP_TTL] != oip[IP_TTL] ||
+        get_u16(&hdr[IP_FRAG]) != get_u16(&oip[IP_FRAG])) {
+        goto uncompressed;
+    }
+
+    cp = deltas;
+    if (th[TCP_FLAGS] & TCP_URG) {
+        cp = vj_encode(cp, get_u16(&th[TCP_URGENT]));
+        changes |= VJ_NEW_U;
+    } else if (get_u16(&th[TCP_URGENT]) != get_u16(&oth[TCP_URGENT])) {
+        goto uncompressed;
+    }
+    delta = get_u16(&th[TCP_WINDOW]) - get_u16(&oth[TCP_WINDOW]);
+    if (delta != 0) {
+        cp = vj_encode(cp, delta);
+        changes |= VJ_NEW_W;
+    }
+    delta_a = get_u32(&th[TCP_ACK_OFF]) - get_u32(&oth[TCP_ACK_OFF]);
+    if (delta_a != 0) {
+        if (delta_a > 0xFFFF) goto uncompressed;
+        cp = vj_encode(cp, (unsigned short)delta_a);
+        changes |= VJ_NEW_A;
+    }
+    delta_s = get_u32(&th[TCP_SEQ_OFF]) - get_u32(&oth[TCP_SEQ_OFF]);
+    if (delta_s != 0) {
+        if (delta_s > 0xFFFF) goto uncompressed;
+        cp = vj_encode(cp, (unsigned short)delta_s);
+        changes |= VJ_NEW_S;
+    }
+
+    old_data_len = get_u16(&oip[IP_TOTAL_LEN]) - VJ_HDR_LEN;
+    switch (changes) {
+    case 0:
+        /* Only data following a pure ACK; otherwise it's a retransmit */
+        if (get_u16(&hdr[IP_TOTAL_LEN]) != get_u16(&oip[IP_TOTAL_LEN]) &&
+            old_data_len == 0) {
+            break;
+        }
+        goto uncompressed;
+    case VJ_SPECIAL_I:
+    case VJ_SPECIAL_D:
+        goto uncompressed;  /* Would be mistaken for the special cases */
+    case VJ_NEW_S | VJ_NEW_A:
+        if (delta_s == delta_a && delta_s == old_data_len) {
+            changes = VJ_SPECIAL_I;  /* Echoed interactive traffic */
+            cp = deltas;
+        }
+        break;
+    case VJ_NEW_S:
+        if (delta_s == old_data_len) {
+            changes = VJ_SPECIAL_D;  /* Unidirectional data */
+            cp = deltas;
+        }
+        break;
+    }
+
+    delta = get_u16(&hdr[IP_ID]) - get_u16(&oip[IP_ID]);
+    if (delta != 1) {
+        cp = vj_encode(cp, delta);
+        changes |= VJ_NEW_I;
+    }
+    if (th[TCP_FLAGS] & TCP_PSH) {
+        changes |= VJ_PUSH;
+    }
+    memcpy(oip, hdr, VJ_HDR_LEN);
+
+    op = out;
+    if (vj_tx_current != slot) {
+        *op++ = VJ_TYPE_COMPRESSED_TCP | VJ_NEW_C | changes;
+        *op++ = slot;
+        vj_tx_current = slot;
+    } else {
+        *op++ = VJ_TYPE_COMPRESSED_TCP | changes;
+    }
+    *cksum_off = (unsigned char)(op - out);
+    *op++ = 0;
+    *op++ = 0;
+    memcpy(op, deltas, cp - deltas);
+    op += cp - deltas;
+    vj_tx_compressed++;
+    return (unsigned char)(op - out);
+
+uncompressed:
+    /* Send the full header, with the slot number in the protocol field */
+    memcpy(vj_tx[slot].hdr, hdr, VJ_HDR_LEN);
+    vj_tx[slot].valid = 1;
+    vj_tx[slot].last_used = ++vj_clock;
+    vj_tx_current = slot;
+    hdr[IP_PROTO] = slot;
+    hdr[IP_VER_IHL] |= VJ_TYPE_UNCOMPRESSED_TCP;
+    return 0;
+}
+
+/* Rebuild a received frame in place as a plain IP datagram. Returns its
+   new length, or 0 if it must be dropped. */
+unsigned short vj_uncompress(unsigned char *pkt, unsigned short len) {
+    unsigned char *ip, *th, *cp;
+    unsigned char changes, slot, hdr_len;
+    unsigned short data_len, old_data_len;
+
+    if (len == 0) return 0;
+
+    if (pkt[0] & VJ_TYPE_COMPRESSED_TCP) {
+        cp = pkt;
+        changes = *cp++;
+        if (changes & VJ_NEW_C) {
+            if (*cp >= VJ_RX_SLOTS) goto bad;
+            vj_rx_current = *cp++;
+            vj_tossing = 0;
+        } else if (vj_tossing) {
+            return 0;
+        }
+        if (vj_rx_current >= VJ_RX_SLOTS || !vj_rx[vj_rx_current].valid) goto bad;
+
+        ip = vj_rx[vj_rx_current].hdr;
+        th = &ip[IP_HEADER_LEN];
+        th[TCP_CHECKSUM] = *cp++;
+        th[TCP_CHECKSUM + 1] = *cp++;
+        if (changes & VJ_PUSH) {
+            th[TCP_FLAGS] |= TCP_PSH;
+        } else {
+            th[TCP_FLAGS] &= ~TCP_PSH;
+        }
+
+        old_data_len = get_u16(&ip[IP_TOTAL_LEN]) - VJ_HDR_LEN;
+        switch (changes & VJ_SPECIALS) {
+        case VJ_SPECIAL_I:
+            put_u32(&th[TCP_ACK_OFF], get_u32(&th[TCP_ACK_OFF]) + old_data_len);
+            put_u32(&th[TCP_SEQ_OFF], get_u32(&th[TCP_SEQ_OFF]) + old_data_len);
+            break;
+        case VJ_SPECIAL_D:
+            put_u32(&th[TCP_SEQ_OFF], get_u32(&th[TCP_SEQ_OFF]) + old_data_len);
+            break;
+        default:
+            if (changes & VJ_NEW_U) {
+                th[TCP_FLAGS] |= TCP_URG;
+                put_u16(&th[TCP_URGENT], vj_decode(&cp));
+            } else {
+                th[TCP_FLAGS] &= ~TCP_URG;
+            }
+            if (changes & VJ_NEW_W) {
+                put_u16(&th[TCP_WINDOW], get_u16(&th[TCP_WINDOW]) + vj_decode(&cp));
+            }
+            if (changes & VJ_NEW_A) {
+                put_u32(&th[TCP_ACK_OFF], get_u32(&th[TCP_ACK_OFF]) + vj_decode(&cp));
+            }
+            if (changes & VJ_NEW_S) {
+                put_u32(&th[TCP_SEQ_OFF], get_u32(&th[TCP_SEQ_OFF]) + vj_decode(&cp));
+            }
+            break;
+        }
+        if (changes & VJ_NEW_I) {
+            put_u16(&ip[IP_ID], get_u16(&ip[IP_ID]) + vj_decode(&cp));
+        } else {
+            put_u16(&ip[IP_ID], get_u16(&ip[IP_ID]) + 1);
+        }
+
+        if ((unsigned short)(cp - pkt) > len) goto bad;
+        data_len = len - (unsigned short)(cp - pkt);
+        if (VJ_HDR_LEN + data_len > PKT_BUF_SIZE) goto bad;
 
-    total_len = IP_HEADER_LEN + payload_len;
+        put_u16(&ip[IP_TOTAL_LEN], VJ_HDR_LEN + data_len);
+        put_u16(&ip[IP_CHECKSUM], 0);
+        put_u16(&ip[IP_CHECKSUM], checksum(ip, IP_HEADER_LEN));
 
-    tx_buf[IP_VER_IHL] = 0x45;
-    tx_buf[IP_TOS] = 0;
-    put_u16(&tx_buf[IP_TOTAL_LEN], total_len);
-    put_u16(&tx_buf[IP_ID], ip_id++);
-    put_u16(&tx_buf[IP_FRAG], 0);
-    tx_buf[IP_TTL] = 64;
-    tx_buf[IP_PROTO] = protocol;
-    put_u16(&tx_buf[IP_CHECKSUM], 0);
-    put_u32(&tx_buf[IP_SRC_IP], local_ip);
-    put_u32(&tx_buf[IP_DST_IP], dst_ip);
+        memmove(&pkt[VJ_HDR_LEN], cp, data_len);
+        memcpy(pkt, ip, VJ_HDR_LEN);
+        vj_rx_compressed++;
+        return VJ_HDR_LEN + data_len;
+    }
 
-    cksum = checksum(tx_buf, IP_HEADER_LEN);
-    put_u16(&tx_buf[IP_CHECKSUM], cksum);
+    if ((pkt[0] & 0xF0) == VJ_TYPE_UNCOMPRESSED_TCP) {
+        /* Full header naming a slot - restore it and remember it */
+        slot = pkt[IP_PROTO];
+        pkt[IP_VER_IHL] &= 0x4F;
+        pkt[IP_PROTO] = IP_PROTO_TCP;
+        hdr_len = (pkt[IP_VER_IHL] & 0x0F) * 4;
+        if (slot >= VJ_RX_SLOTS || len < hdr_len + TCP_HEADER_LEN) goto bad;
+        hdr_len += (pkt[hdr_len + TCP_DATA_OFF] >> 4) * 4;
+        if (len < hdr_len) goto bad;
+
+        /* Headers with options are passed up but can't be tracked */
+        vj_rx[slot].valid = (hdr_len == VJ_HDR_LEN);
+        memcpy(vj_rx[slot].hdr, pkt, VJ_HDR_LEN);
+        vj_rx_current = slot;
+        vj_tossing = 0;
+    }
+    return len;
 
-    memcpy(&tx_buf[IP_HEADER_LEN], payload, payload_len);
-    slip_send(tx_buf, (unsigned char)total_len);
+bad:
+    vj_rx_errors++;
+    vj_toss();
+    return 0;
 }
 
 /*============================================================================
@@ -409,22 +788,20 @@ void ip_send(unsigned long dst_ip, unsigned char protocol,
 #define ICMP_SEQ      6
 #define ICMP_HEADER_LEN 8
 
+#define ICMP_PROBE_ID   0x504F  /* "PO" - identifies our own echo requests */
+
 unsigned short ping_replied = 0;
+unsigned short probe_reply_seq = 0;  /* Sequence of last probe answered */
 
 void icmp_receive(unsigned char *pkt, unsigned short len, unsigned long src_ip) {
     unsigned char type;
-    unsigned short cksum, calc_cksum;
+    unsigned short cksum;
     unsigned short id, seq;
     unsigned char ip_bytes[4];
 
     if (len < ICMP_HEADER_LEN) return;
 
-    cksum = get_u16(&pkt[ICMP_CHECKSUM]);
-    put_u16(&pkt[ICMP_CHECKSUM], 0);
-    calc_cksum = checksum(pkt, len);
-    put_u16(&pkt[ICMP_CHECKSUM], cksum);
-
-    if (calc_cksum != cksum) return;
+    if (checksum(pkt, len) != 0) return;
 
     type = pkt[ICMP_TYPE];
     id = get_u16(&pkt[ICMP_ID]);
@@ -443,17 +820,84 @@ void icmp_receive(unsigned char *pkt, unsigned short len, unsigned long src_ip)
         print_uint(ip_bytes[3]);
         print_str(" seq="); print_uint(seq); putch('\r'); putch('\n');
 
+        /* Only the type and code word changes */
+        cksum = checksum_adjust(get_u16(&pkt[ICMP_CHECKSUM]), get_u16(&pkt[ICMP_TYPE]),
+                                ICMP_ECHO_REPLY << 8);
         pkt[ICMP_TYPE] = ICMP_ECHO_REPLY;
         pkt[ICMP_CODE] = 0;
-        put_u16(&pkt[ICMP_CHECKSUM], 0);
-        cksum = checksum(pkt, len);
         put_u16(&pkt[ICMP_CHECKSUM], cksum);
 
         ip_send(src_ip, IP_PROTO_ICMP, pkt, len);
         ping_replied++;
+    } else if (type == ICMP_ECHO_REPLY && id == ICMP_PROBE_ID) {
+        probe_reply_seq = seq;
+    }
+}
+
+/* Send an echo request to the peer, used to probe the link */
+void icmp_send_probe(unsigned long dst_ip, unsigned short seq) {
+    unsigned char probe[ICMP_HEADER_LEN + 4];
+
+    probe[ICMP_TYPE] = ICMP_ECHO_REQUEST;
+    probe[ICMP_CODE] = 0;
+    put_u16(&probe[ICMP_CHECKSUM], 0);
+    put_u16(&probe[ICMP_ID], ICMP_PROBE_ID);
+    put_u16(&probe[ICMP_SEQ], seq);
+    memcpy(&probe[ICMP_HEADER_LEN], "pofo", 4);
+    put_u16(&probe[ICMP_CHECKSUM], checksum(probe, sizeof(probe)));
+
+    ip_send(dst_ip, IP_PROTO_ICMP, probe, sizeof(probe));
+}
+
+/*============================================================================
+ * Baud Rate Negotiation
+ *============================================================================*/
+
+#define AUTOBAUD_WAIT  9   /* ticks (~0.5s) to wait for each probe reply */
+#define AUTOBAUD_TRIES 2   /* probes per rate */
+
+/* Candidate rates, fastest first */
+unsigned short autobaud_divisors[] = {
+    BAUD_DIVISOR(115200UL), BAUD_DIVISOR(57600UL), BAUD_DIVISOR(38400UL),
+    BAUD_DIVISOR(19200UL), BAUD_DIVISOR(9600UL)
+};
+
+/* Step down through the candidate rates until the peer answers a ping.
+   Returns 1 and leaves the UART at the first working rate, or returns 0
+   and restores the original rate if the peer never answered. */
+unsigned char slip_autobaud(unsigned long peer_ip) {
+    unsigned short fallback = serial_divisor;
+    unsigned short seq = 0;
+    unsigned char i, attempt;
+    unsigned long start;
+
+    for (i = 0; i < sizeof(autobaud_divisors) / sizeof(autobaud_divisors[0]); i++) {
+        tx_flush();
+        set_baud_divisor(autobaud_divisors[i]);
+
+        for (attempt = 0; attempt < AUTOBAUD_TRIES; attempt++) {
+            /* Discard anything decoded at the previous rate */
+            while (rx_available()) (void)rx_getchar();
+            pkt_len = 0;
+            slip_escaped = 0;
+
+            icmp_send_probe(peer_ip, ++seq);
+            start = get_tick_count();
+            while ((get_tick_count() - start) < AUTOBAUD_WAIT) {
+                if (slip_poll()) {
+                    ip_receive(slip_frame, pkt_len);
+                    pkt_len = 0;
+                }
+                if (probe_reply_seq == seq) {
+                    return 1;
+                }
+            }
+        }
     }
 
-    (void)id;
+    tx_flush();
+    set_baud_divisor(fallback);
+    return 0;
 }
 
 /*============================================================================
@@ -477,271 +921,1195 @@ void udp_receive(unsigned char *pkt, unsigned short len, unsigned long src_ip) {
  * TCP Layer
  *============================================================================*/
 
-unsigned char tcp_state = TCP_STATE_CLOSED;
-unsigned long tcp_remote_ip = 0;
-unsigned short tcp_local_port = 0;
-unsigned short tcp_remote_port = 0;
-unsigned long tcp_seq_num = 0;
-unsigned long tcp_ack_num = 0;
-unsigned long tcp_last_ack = 0;
+struct tcp_conn tcp_conns[TCP_MAX_CONNS];
+unsigned short tcp_local_port = 0;       /* Port we listen on */
+
+#define TCP_HANDLE(tc) ((unsigned char)((tc) - tcp_conns))
+
+/* Persist timer: probes the peer when its window is too small for the
+   next segment and nothing in flight will bring an update */
+#define PERSIST_MIN  18    /* ticks (~1s) */
+#define PERSIST_MAX  1092  /* ticks (~60s) */
+
+unsigned short tcp_window_probes = 0;
+
+/* Header-only segments are built here */
+unsigned char tcp_ctl_pkt[TCP_HEADROOM];
+
+/* Payload bytes handed to TCP, and how many of them had to be copied */
+unsigned long tcp_bytes_sent = 0;
+unsigned long tcp_bytes_copied = 0;
+
+/* Header prediction hits and misses */
+unsigned short tcp_fast_acks = 0;
+unsigned short tcp_fast_data = 0;
+unsigned short tcp_slow_path = 0;
 
-unsigned char tcp_buf[TCP_HEADER_LEN + 64];
-unsigned char pseudo_hdr[12];
+/* Delayed ACK: received data is acknowledged by our next segment if one
+   goes out soon, by the second segment received, or after DELACK_TICKS */
+#define DELACK_TICKS 4  /* ~220ms */
 
-/* Retransmission support */
-#define RETX_BUF_SIZE 64
-#define RETX_TIMEOUT  2   /* seconds */
-#define RETX_MAX_ATTEMPTS 3
+unsigned short tcp_acks_piggybacked = 0;
+unsigned short tcp_acks_delayed = 0;
 
-unsigned char retx_buf[RETX_BUF_SIZE];  /* Buffer for unACKed data */
-unsigned char retx_len = 0;              /* Length of data in buffer */
-unsigned long retx_seq = 0;              /* Sequence number of buffered data */
-unsigned long retx_time = 0;             /* Tick count when sent */
-unsigned char retx_attempts = 0;         /* Retry counter */
+/* Receive window. Every byte the peer may send has to fit in the serial
+   ring while the application is busy, headers and SLIP framing included,
+   so the window is what is free there less that overhead. A window that
+   was too small for a full segment is reopened with an update. */
+#define RX_SEG_OVERHEAD (TCP_HEADROOM + 2)  /* Headers and two ENDs */
 
-/* Forward declaration */
-unsigned long get_tick_count(void);
+unsigned short tcp_window_updates = 0;
 
-/* Connection queue for pending SYNs */
+/* Set while the application handles received data. It may wait for send
+   space meanwhile; segments arriving then are only taken for their ACKs. */
+unsigned char tcp_app_busy = 0;
+
+/* Retransmission support. The timeout comes from the round-trip time,
+   measured on one segment at a time (Jacobson/Karels). As in BSD, SRTT is
+   kept scaled by 8 and RTTVAR by 4, all in BIOS ticks (~55ms). Each
+   timeout doubles it, and it stays doubled until a segment sent only once
+   is timed (Karn): the ACK of a retransmission can't say how long the
+   path takes. */
+#define RTO_INITIAL  18    /* ticks (~1s) until the first measurement */
+#define RTO_MIN      4     /* ticks (~220ms) */
+#define RTO_MAX      1092  /* ticks (~60s) */
+#define RTO_MAX_SHIFT 10   /* RTO_MIN doubled this often is past RTO_MAX */
+#define RETX_MAX_ATTEMPTS 4
+
+/* Idle timers. A connection whose peer has sent nothing new for this
+   long is reset, so a vanished client can't hold a slot the backlog is
+   waiting for. Outstanding data is covered sooner by the retransmit
+   timer; these catch silent peers, windows that never reopen and FINs
+   that never come. */
+#define IDLE_TIMEOUT     546  /* ticks (~30s) */
+#define FIN_WAIT_TIMEOUT 182  /* ticks (~10s) for the peer's FIN after ours */
+
+unsigned short tcp_idle_resets = 0;
+
+unsigned short tcp_retransmits = 0;
+
+/* Fast retransmit: the peer repeats its ACK for every segment that
+   arrives after a gap, so the third duplicate resends the missing one */
+#define DUP_ACK_THRESHOLD 3
+
+unsigned short tcp_fast_retransmits = 0;
+
+/* Our initial sequence number */
+#define TCP_ISS 1000
+
+/* Connection queue for SYNs that arrive while every slot is taken,
+   oldest first. A client sending its SYN again keeps its place. */
 #define CONN_QUEUE_SIZE 16
-#define CONN_QUEUE_TIMEOUT 10  /* seconds - expire old entries */
+/* Ticks since we last heard from an entry before it is dropped: longer
+   than a client's SYN backoff (32s between the last tries on Linux), and
+   once it has completed the handshake, longer than its probes of our
+   closed window, which back off to two minutes */
+#define CONN_QUEUE_TIMEOUT       1183  /* ~65s */
+#define CONN_QUEUE_PROBE_TIMEOUT 2366  /* ~130s */
 
 struct pending_conn {
     unsigned long  remote_ip;
     unsigned short remote_port;
     unsigned long  their_seq;    /* Their initial sequence number */
-    unsigned long  timestamp;    /* When SYN was received */
-    unsigned char  valid;        /* Entry in use */
+    unsigned short their_mss;    /* Largest segment they will take */
+    unsigned short their_window; /* Window they last advertised */
+    unsigned long  timestamp;    /* When we last heard from them */
+    unsigned char  synack_sent;  /* Answered early, with a closed window */
+    unsigned char  acked;        /* ... and they completed the handshake */
 };
 
 struct pending_conn conn_queue[CONN_QUEUE_SIZE];
 unsigned char conn_queue_count = 0;
 
-/* Add connection to queue */
-void conn_queue_add(unsigned long ip, unsigned short port, unsigned long seq) {
+/* Set to answer queued SYNs at once. The handshake then overlaps the
+   transfers in progress, and the client only waits for the window. */
+unsigned char tcp_early_synack = 0;
+
+/* Answer a peer that has no connection slot, with the window closed */
+void tcp_reply(unsigned long ip, unsigned short port, unsigned long seq,
+               unsigned long ack, unsigned char flags) {
+    unsigned char *th = &tcp_ctl_pkt[IP_HEADER_LEN];
+    unsigned char mss_opt[TCP_MSS_OPT_LEN];
+    unsigned char opt_len = (flags & TCP_SYN) ? TCP_MSS_OPT_LEN : 0;
+    unsigned short tcp_len = TCP_HEADER_LEN + opt_len;
+
+    mss_opt[0] = TCP_OPT_MSS;
+    mss_opt[1] = TCP_MSS_OPT_LEN;
+    put_u16(&mss_opt[2], TCP_MSS);
+
+    put_u16(&th[TCP_SRC_PORT], tcp_local_port);
+    put_u16(&th[TCP_DST_PORT], port);
+    put_u32(&th[TCP_SEQ_OFF], seq);
+    put_u32(&th[TCP_ACK_OFF], ack);
+    th[TCP_DATA_OFF] = opt_len ? 0x60 : 0x50;
+    th[TCP_FLAGS] = flags;
+    put_u16(&th[TCP_WINDOW], 0);
+    put_u16(&th[TCP_CHECKSUM], 0);
+    put_u16(&th[TCP_URGENT], 0);
+
+    ip_build_header(tcp_ctl_pkt, ip, IP_PROTO_TCP, tcp_len);
+    while (!slip_queue_packet(tcp_ctl_pkt, TCP_HEADROOM, mss_opt, opt_len,
+                              IP_HEADER_LEN + TCP_CHECKSUM,
+                              checksum_add(tcp_pseudo_sum(local_ip, ip, tcp_len),
+                                           th, TCP_HEADER_LEN)));
+}
+
+/* Answer a queued peer: a SYN+ACK or ACK, with the window closed until
+   a slot is free, or a RST */
+void conn_queue_reply(struct pending_conn *pc, unsigned char flags) {
+    tcp_reply(pc->remote_ip, pc->remote_port,
+              (flags & TCP_SYN) ? TCP_ISS : TCP_ISS + 1, pc->their_seq + 1, flags);
+}
+
+/* The queue entry for this peer, or 0 */
+struct pending_conn *conn_queue_find(unsigned long ip, unsigned short port) {
     unsigned char i;
+
+    for (i = 0; i < conn_queue_count; i++) {
+        if (conn_queue[i].remote_ip == ip && conn_queue[i].remote_port == port) {
+            return &conn_queue[i];
+        }
+    }
+    return 0;
+}
+
+/* Take entry i out of the queue, keeping the rest in order */
+void conn_queue_remove(unsigned char i) {
+    conn_queue_count--;
+    for (; i < conn_queue_count; i++) {
+        conn_queue[i] = conn_queue[i + 1];
+    }
+}
+
+/* Drop entries not heard from in CONN_QUEUE_TIMEOUT (or
+   CONN_QUEUE_PROBE_TIMEOUT), resetting any we already answered */
+void conn_queue_expire(void) {
+    unsigned char i = 0;
     unsigned long now = get_tick_count();
 
-    /* Find empty slot or oldest entry */
-    for (i = 0; i < CONN_QUEUE_SIZE; i++) {
-        if (!conn_queue[i].valid) {
-            conn_queue[i].remote_ip = ip;
-            conn_queue[i].remote_port = port;
-            conn_queue[i].their_seq = seq;
-            conn_queue[i].timestamp = now;
-            conn_queue[i].valid = 1;
-            conn_queue_count++;
+    while (i < conn_queue_count) {
+        if ((now - conn_queue[i].timestamp) >
+            (conn_queue[i].acked ? CONN_QUEUE_PROBE_TIMEOUT : CONN_QUEUE_TIMEOUT)) {
+            if (conn_queue[i].synack_sent) {
+                conn_queue_reply(&conn_queue[i], TCP_RST | TCP_ACK);
+            }
+            conn_queue_remove(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Add connection to queue, or refresh its entry if it is already there */
+void conn_queue_add(unsigned long ip, unsigned short port, unsigned long seq,
+                    unsigned short mss, unsigned short window) {
+    struct pending_conn *pc = conn_queue_find(ip, port);
+
+    if (pc && pc->their_seq != seq) {
+        /* A new connection from the same port: start over at the back */
+        conn_queue_remove((unsigned char)(pc - conn_queue));
+        pc = 0;
+    }
+    if (!pc) {
+        conn_queue_expire();
+        if (conn_queue_count == CONN_QUEUE_SIZE) {
+            return;  /* Full - the client will try again */
+        }
+        pc = &conn_queue[conn_queue_count++];
+        pc->remote_ip = ip;
+        pc->remote_port = port;
+        pc->their_seq = seq;
+        pc->their_mss = mss;
+        pc->their_window = window;
+        pc->synack_sent = 0;
+        pc->acked = 0;
+    }
+    pc->timestamp = get_tick_count();
+
+    /* Our SYN+ACK is sent again if the client repeats its SYN */
+    if (tcp_early_synack && !pc->acked) {
+        conn_queue_reply(pc, TCP_SYN | TCP_ACK);
+        pc->synack_sent = 1;
+    }
+}
+
+/* A segment other than a SYN from a peer that may be queued */
+void conn_queue_segment(struct pending_conn *pc, unsigned char flags,
+                        unsigned long ack_num, unsigned short window) {
+    if (!pc->synack_sent) {
+        return;
+    }
+    if (flags & TCP_RST) {
+        conn_queue_remove((unsigned char)(pc - conn_queue));
+        return;
+    }
+    if ((flags & TCP_ACK) && SEQ_EQ(ack_num, TCP_ISS + 1)) {
+        if (pc->acked) {
+            /* A window probe: say it is still closed, so the client
+               knows we are there and keeps waiting */
+            conn_queue_reply(pc, TCP_ACK);
+        }
+        pc->acked = 1;
+        pc->their_window = window;
+        pc->timestamp = get_tick_count();
+    }
+}
+
+/* Take the oldest entry off the queue, return 1 if there was one */
+unsigned char conn_queue_pop(struct pending_conn *pc) {
+    if (conn_queue_count == 0) {
+        return 0;
+    }
+    *pc = conn_queue[0];
+    conn_queue_remove(0);
+    return 1;
+}
+
+/* Segments that arrive ahead of a gap are held here, a few shared by
+   all connections, until the missing data comes and they follow it to
+   the application. A single loss then costs one segment, not all of
+   those after it. */
+#define TCP_OOO_SLOTS 2
+
+struct tcp_ooo_seg {
+    unsigned char  valid;
+    unsigned char  conn;             /* Handle of the connection it is for */
+    unsigned long  seq;
+    unsigned short len;
+    unsigned char  data[TCP_MSS];
+};
+
+struct tcp_ooo_seg tcp_ooo[TCP_OOO_SLOTS];
+
+/* Segments received again, and ahead of a gap */
+unsigned short tcp_rx_dups = 0;
+unsigned short tcp_rx_ooo = 0;
+
+/* Hold a segment from beyond the next expected byte, unless there's
+   no room or it is already held */
+void tcp_ooo_store(unsigned char conn, unsigned long seq, unsigned char *data,
+                   unsigned short len) {
+    struct tcp_ooo_seg *os = 0;
+    unsigned char i;
+
+    for (i = 0; i < TCP_OOO_SLOTS; i++) {
+        if (!tcp_ooo[i].valid) {
+            os = &tcp_ooo[i];
+        } else if (tcp_ooo[i].conn == conn && SEQ_EQ(tcp_ooo[i].seq, seq)) {
             return;
         }
     }
-    /* Queue full - could replace oldest, but just drop for now */
+    if (os && len <= TCP_MSS) {
+        os->valid = 1;
+        os->conn = conn;
+        os->seq = seq;
+        os->len = len;
+        memcpy(os->data, data, len);
+        tcp_rx_ooo++;
+    }
 }
 
-/* Get next connection from queue, return 1 if found */
-unsigned char conn_queue_pop(unsigned long *ip, unsigned short *port, unsigned long *seq) {
+/* A held segment that starts at or before seq, the next byte wanted */
+struct tcp_ooo_seg *tcp_ooo_next(unsigned char conn, unsigned long seq) {
     unsigned char i;
-    unsigned long now = get_tick_count();
 
-    for (i = 0; i < CONN_QUEUE_SIZE; i++) {
-        if (conn_queue[i].valid) {
-            /* Check if expired */
-            if ((now - conn_queue[i].timestamp) > CONN_QUEUE_TIMEOUT) {
-                conn_queue[i].valid = 0;
-                conn_queue_count--;
-                continue;
-            }
-            /* Found valid entry */
-            *ip = conn_queue[i].remote_ip;
-            *port = conn_queue[i].remote_port;
-            *seq = conn_queue[i].their_seq;
-            conn_queue[i].valid = 0;
-            conn_queue_count--;
-            return 1;
+    for (i = 0; i < TCP_OOO_SLOTS; i++) {
+        if (tcp_ooo[i].valid && tcp_ooo[i].conn == conn && SEQ_LEQ(tcp_ooo[i].seq, seq)) {
+            return &tcp_ooo[i];
         }
     }
     return 0;
 }
 
-/* Process next pending connection from queue */
-void tcp_process_queue(void) {
-    unsigned long ip;
-    unsigned short port;
-    unsigned long seq;
+/* Forget what is held for a connection */
+void tcp_ooo_drop(unsigned char conn) {
+    unsigned char i;
 
-    if (tcp_state != TCP_STATE_LISTEN) return;
+    for (i = 0; i < TCP_OOO_SLOTS; i++) {
+        if (tcp_ooo[i].conn == conn) {
+            tcp_ooo[i].valid = 0;
+        }
+    }
+}
 
-    if (conn_queue_pop(&ip, &port, &seq)) {
-        print_str("[Dequeue: "); print_uint(conn_queue_count); print_str(" remaining]\r\n");
-        if (app_tcp_accept(ip, port)) {
-            tcp_remote_ip = ip;
-            tcp_remote_port = port;
-            tcp_seq_num = 1000;
-            tcp_ack_num = seq + 1;
-            tcp_send_flags(TCP_SYN | TCP_ACK, 0, 0);
-            tcp_state = TCP_STATE_SYN_RECEIVED;
-            retx_time = get_tick_count();  /* Track when SYN+ACK was sent */
-            app_tcp_state_changed(TCP_STATE_LISTEN, tcp_state, ip, port);
+/* Take on a new peer in a connection slot and reset its state */
+void tcp_set_remote(unsigned char conn, unsigned long ip, unsigned short port) {
+    struct tcp_conn *tc = &tcp_conns[conn];
+
+    tcp_ooo_drop(conn);
+    tc->remote_ip = ip;
+    tc->remote_port = port;
+    tc->pseudo_base = tcp_pseudo_sum(local_ip, ip, 0);
+    tc->ack_th_valid = 0;
+    tc->sendq_head = 0;
+    tc->sendq_count = 0;
+    tc->sendq_sent = 0;
+    tc->close_pending = 0;
+    tc->write_len = 0;
+    tc->persist_interval = 0;
+    tc->retx_attempts = 0;
+    tc->rto_shift = 0;
+    tc->srtt = 0;
+    tc->rttvar = 0;
+    tc->rto = RTO_INITIAL;
+    tc->rtt_timing = 0;
+    tc->dup_acks = 0;
+    tc->ack_pending = 0;
+    tc->rcv_idle = 0;
+    tc->heard_time = get_tick_count();
+}
+
+/* Move a connection to a new state and tell the application */
+void tcp_set_state(struct tcp_conn *tc, unsigned char state) {
+    unsigned char old_state = tc->state;
+
+    tc->state = state;
+    app_tcp_state_changed(TCP_HANDLE(tc), old_state, state, tc->remote_ip, tc->remote_port);
+}
+
+/* The connection slot with this peer, or 0 */
+struct tcp_conn *tcp_find(unsigned long ip, unsigned short port) {
+    unsigned char i;
+
+    for (i = 0; i < TCP_MAX_CONNS; i++) {
+        if (tcp_conns[i].state != TCP_STATE_CLOSED &&
+            tcp_conns[i].remote_ip == ip && tcp_conns[i].remote_port == port) {
+            return &tcp_conns[i];
         }
     }
+    return 0;
 }
 
-/* Read BIOS tick counter from 0040:006C */
-unsigned long get_tick_count(void) {
-    unsigned long ticks = 0;
-    __asm {
-        push es
-        mov ax, 0x0040
-        mov es, ax
-        mov bx, 0x006C
-        mov ax, es:[bx]
-        mov dx, es:[bx+2]
-        mov word ptr ticks, ax
-        mov word ptr ticks+2, dx
-        pop es
+/* An unused connection slot, or 0 if all are taken */
+struct tcp_conn *tcp_find_free(void) {
+    unsigned char i;
+
+    for (i = 0; i < TCP_MAX_CONNS; i++) {
+        if (tcp_conns[i].state == TCP_STATE_CLOSED) {
+            return &tcp_conns[i];
+        }
     }
-    return ticks;
+    return 0;
+}
+
+/* Tick count by which the UART will have sent everything queued so far.
+   A segment's timers start from there: at low rates it can wait behind
+   other connections' data for longer than the round trip itself. */
+unsigned long tcp_departure_time(void) {
+    unsigned long queued = TX_QUEUE_SIZE - 1 - tx_free();
+
+    return get_tick_count() + queued * 182 / DIVISOR_BAUD(serial_divisor);
+}
+
+void tcp_send_flags(struct tcp_conn *tc, unsigned char flags,
+                    unsigned char *data, unsigned short data_len);
+
+/* Answer a SYN from a slot, if the application wants the connection.
+   A peer that completed the handshake while queued is told the window is
+   open, which has it send at once. */
+void tcp_accept(struct tcp_conn *tc, struct pending_conn *pc) {
+    if (!app_tcp_accept(pc->remote_ip, pc->remote_port)) {
+        if (pc->synack_sent) {
+            conn_queue_reply(pc, TCP_RST | TCP_ACK);
+        }
+        return;
+    }
+    tcp_set_remote(TCP_HANDLE(tc), pc->remote_ip, pc->remote_port);
+    tc->seq_num = TCP_ISS;
+    tc->ack_num = pc->their_seq + 1;
+    tc->rcv_adv = tc->ack_num;
+    tc->snd_mss = pc->their_mss;
+    tc->snd_wnd = pc->their_window;
+    if (pc->acked) {
+        tc->seq_num = TCP_ISS + 1;
+        tc->last_ack = tc->seq_num;
+        tcp_set_state(tc, TCP_STATE_ESTABLISHED);
+        tcp_send_flags(tc, TCP_ACK, 0, 0);
+        return;
+    }
+    tcp_send_flags(tc, TCP_SYN | TCP_ACK, 0, 0);
+    tc->retx_time = tcp_departure_time();  /* Track when SYN+ACK was sent */
+    tcp_set_state(tc, TCP_STATE_SYN_RECEIVED);
+}
+
+/* A free slot, or failing that one whose FIN has been acknowledged.
+   That has nothing left to send, so it is given up without waiting for
+   the peer's FIN, which tcp_receive then answers without a slot. */
+struct tcp_conn *tcp_find_slot(void) {
+    struct tcp_conn *tc = tcp_find_free();
+    unsigned char i;
+
+    for (i = 0; !tc && i < TCP_MAX_CONNS; i++) {
+        if (tcp_conns[i].state == TCP_STATE_FIN_WAIT_2) {
+            tc = &tcp_conns[i];
+            tcp_set_state(tc, TCP_STATE_CLOSED);
+        }
+    }
+    return tc;
+}
+
+/* Start queued connections while there are free slots */
+void tcp_process_queue(void) {
+    struct tcp_conn *tc;
+    struct pending_conn pc;
+
+    if (tcp_app_busy) {
+        return;  /* net_poll tries again once the application is done */
+    }
+    /* Expire first, so a slot is only taken over for a live entry */
+    conn_queue_expire();
+    while (conn_queue_count > 0 && (tc = tcp_find_slot()) != 0) {
+        conn_queue_pop(&pc);
+        print_str("[Dequeue: "); print_uint(conn_queue_count); print_str(" remaining]\r\n");
+        tcp_accept(tc, &pc);
+    }
+}
+
+/* Free a connection's slot and let a queued one have it */
+void tcp_closed(struct tcp_conn *tc) {
+    tc->sendq_count = 0;
+    tc->sendq_sent = 0;
+    tcp_ooo_drop(TCP_HANDLE(tc));
+    tcp_set_state(tc, TCP_STATE_CLOSED);
+    tcp_process_queue();
+}
+
+/* Sum of the TCP pseudo-header */
+unsigned long tcp_pseudo_sum(unsigned long src_ip, unsigned long dst_ip,
+                             unsigned short tcp_len) {
+    return (src_ip >> 16) + (src_ip & 0xFFFF) +
+           (dst_ip >> 16) + (dst_ip & 0xFFFF) +
+           IP_PROTO_TCP + tcp_len;
 }
 
 unsigned short tcp_checksum(unsigned char *tcp_pkt, unsigned short tcp_len,
                             unsigned long src_ip, unsigned long dst_ip) {
-    unsigned long sum = 0;
-    unsigned short i;
+    return checksum_fold(checksum_add(tcp_pseudo_sum(src_ip, dst_ip, tcp_len),
+                                      tcp_pkt, tcp_len));
+}
 
-    put_u32(&pseudo_hdr[0], src_ip);
-    put_u32(&pseudo_hdr[4], dst_ip);
-    pseudo_hdr[8] = 0;
-    pseudo_hdr[9] = IP_PROTO_TCP;
-    put_u16(&pseudo_hdr[10], tcp_len);
+/* Checksum of th worked out from old_th's, adjusting for each word that
+   differs. Both must cover the same payload and pseudo-header. */
+unsigned short tcp_checksum_update(unsigned char *old_th, unsigned char *th) {
+    unsigned short cksum = get_u16(&old_th[TCP_CHECKSUM]);
+    unsigned short old_word, new_word;
+    unsigned char i;
 
-    for (i = 0; i < 12; i += 2) {
-        sum += ((unsigned short)pseudo_hdr[i] << 8) | pseudo_hdr[i + 1];
-    }
-    for (i = 0; i + 1 < tcp_len; i += 2) {
-        sum += ((unsigned short)tcp_pkt[i] << 8) | tcp_pkt[i + 1];
+    for (i = 0; i < TCP_HEADER_LEN; i += 2) {
+        old_word = get_u16(&old_th[i]);
+        new_word = get_u16(&th[i]);
+        if (i != TCP_CHECKSUM && old_word != new_word) {
+            cksum = checksum_adjust(cksum, old_word, new_word);
+        }
     }
-    if (tcp_len & 1) {
-        sum += (unsigned short)tcp_pkt[tcp_len - 1] << 8;
+    return cksum;
+}
+
+/* Payload that fits in room bytes of the receive ring, allowing for
+   each segment's headers and framing and 1 byte in 32 being escaped */
+unsigned short tcp_rx_payload(unsigned short room) {
+    unsigned short framing = (room / (TCP_MSS + RX_SEG_OVERHEAD) + 1) * RX_SEG_OVERHEAD +
+                             room / 32;
+
+    return room > framing ? room - framing : 0;
+}
+
+/* Connections that share the receive ring with tc: tc itself and those
+   whose peers may still send data. The application has closed those in
+   FIN_WAIT_1 and FIN_WAIT_2, so their data would only be dropped, and
+   gives up the share of one it is keeping open between requests. */
+unsigned char tcp_rx_sharers(struct tcp_conn *tc) {
+    struct tcp_conn *oc;
+    unsigned char n = 0;
+
+    for (oc = tcp_conns; oc < &tcp_conns[TCP_MAX_CONNS]; oc++) {
+        if (oc == tc || ((oc->state == TCP_STATE_SYN_RECEIVED ||
+                          oc->state == TCP_STATE_ESTABLISHED) && !oc->rcv_idle)) {
+            n++;
+        }
     }
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+    return n;
+}
+
+/* tc's part of the room left in the receive ring. Frames not yet taken
+   from the ring count against it, and what is left is split evenly, so
+   that no connection - one kept open between requests, say - holds the
+   whole ring and leaves the others a closed window. */
+unsigned short tcp_rx_room(struct tcp_conn *tc) {
+    unsigned short room = RX_BUF_SIZE - 1 - ((rx_head - rx_tail) & RX_BUF_MASK);
+
+    return tcp_rx_payload(room) / tcp_rx_sharers(tc);
+}
+
+/* Window to advertise now. Its right edge never moves back, as the peer
+   may already have sent up to it. */
+unsigned short tcp_rx_window(struct tcp_conn *tc) {
+    unsigned short wnd = tcp_rx_room(tc);
+
+    if (SEQ_LT(tc->ack_num + wnd, tc->rcv_adv)) {
+        return (unsigned short)(tc->rcv_adv - tc->ack_num);
     }
-    return (unsigned short)(~sum);
+    tc->rcv_adv = tc->ack_num + wnd;
+    return wnd;
 }
 
-void tcp_send_flags(unsigned char flags, unsigned char *data, unsigned char data_len) {
+/* Build the headers in the TCP_HEADROOM bytes at pkt and queue them with
+   the payload. A SYN's payload is its MSS option, which goes with the
+   header. If old_th is given, it was sent before with this same
+   payload and the checksum is adjusted from it; otherwise the header is
+   summed here and the payload while it is escaped. */
+void tcp_output(struct tcp_conn *tc, unsigned char *pkt, unsigned long seq,
+                unsigned char flags, unsigned char *data, unsigned short data_len,
+                unsigned char *old_th) {
+    unsigned char *th = &pkt[IP_HEADER_LEN];
+    unsigned char vj_hdr[VJ_HDR_LEN];
+    unsigned char *hdr = pkt;
+    unsigned char hdr_len = TCP_HEADROOM;
+    unsigned char cksum_off = IP_HEADER_LEN + TCP_CHECKSUM;
+    unsigned char vj_cksum_off;
     unsigned short tcp_len;
-    unsigned short cksum;
+    unsigned long sum = 0;
 
     tcp_len = TCP_HEADER_LEN + data_len;
 
-    put_u16(&tcp_buf[TCP_SRC_PORT], tcp_local_port);
-    put_u16(&tcp_buf[TCP_DST_PORT], tcp_remote_port);
-    put_u32(&tcp_buf[TCP_SEQ_OFF], tcp_seq_num);
-    put_u32(&tcp_buf[TCP_ACK_OFF], tcp_ack_num);
-    tcp_buf[TCP_DATA_OFF] = 0x50;
-    tcp_buf[TCP_FLAGS] = flags;
-    put_u16(&tcp_buf[TCP_WINDOW], 2048);
-    put_u16(&tcp_buf[TCP_CHECKSUM], 0);
-    put_u16(&tcp_buf[TCP_URGENT], 0);
+    /* Every segment carries ack_num, so nothing is held back after it */
+    if (tc->ack_pending) {
+        if (data_len > 0) tcp_acks_piggybacked++;
+        tc->ack_pending = 0;
+    }
+
+    put_u16(&th[TCP_SRC_PORT], tcp_local_port);
+    put_u16(&th[TCP_DST_PORT], tc->remote_port);
+    put_u32(&th[TCP_SEQ_OFF], seq);
+    put_u32(&th[TCP_ACK_OFF], tc->ack_num);
+    th[TCP_DATA_OFF] = (flags & TCP_SYN) ? 0x60 : 0x50;
+    th[TCP_FLAGS] = flags;
+    put_u16(&th[TCP_WINDOW], tcp_rx_window(tc));
+    put_u16(&th[TCP_CHECKSUM], 0);
+    put_u16(&th[TCP_URGENT], 0);
+
+    ip_build_header(pkt, tc->remote_ip, IP_PROTO_TCP, tcp_len);
+
+    if (old_th) {
+        put_u16(&th[TCP_CHECKSUM], tcp_checksum_update(old_th, th));
+        cksum_off = 0;
+    } else {
+        sum = checksum_add(tc->pseudo_base + tcp_len, th, TCP_HEADER_LEN);
+    }
+
+    if (cslip_enabled) {
+        hdr_len = vj_compress(pkt, vj_hdr, &vj_cksum_off);
+        if (hdr_len > 0) {
+            hdr = vj_hdr;
+            if (cksum_off) {
+                cksum_off = vj_cksum_off;
+            } else {
+                put_u16(&vj_hdr[vj_cksum_off], get_u16(&th[TCP_CHECKSUM]));
+            }
+        } else {
+            hdr_len = TCP_HEADROOM;
+        }
+    }
 
+    while (!slip_queue_packet(hdr, hdr_len, data, data_len, cksum_off, sum));
+
+    /* Keep the final checksum with the header for later adjustment */
+    if (cksum_off) {
+        put_u16(&th[TCP_CHECKSUM], get_u16(&hdr[cksum_off]));
+    }
+}
+
+/* Send a segment straight away at seq_num. Data sent this way is not
+   queued for retransmission. */
+void tcp_send_flags(struct tcp_conn *tc, unsigned char flags,
+                    unsigned char *data, unsigned short data_len) {
+    unsigned char mss_opt[TCP_MSS_OPT_LEN];
+
+    if (flags & TCP_SYN) {
+        /* Tell the peer how big a segment we can take */
+        mss_opt[0] = TCP_OPT_MSS;
+        mss_opt[1] = TCP_MSS_OPT_LEN;
+        put_u16(&mss_opt[2], TCP_MSS);
+        tcp_output(tc, tcp_ctl_pkt, tc->seq_num, flags, mss_opt, TCP_MSS_OPT_LEN, 0);
+        tc->ack_th_valid = 0;
+        tc->seq_num++;
+        return;
+    }
     if (data_len > 0) {
-        memcpy(&tcp_buf[TCP_HEADER_LEN], data, data_len);
+        tcp_output(tc, tcp_ctl_pkt, tc->seq_num, flags, data, data_len, 0);
+        tc->ack_th_valid = 0;
+    } else {
+        tcp_output(tc, tcp_ctl_pkt, tc->seq_num, flags, 0, 0,
+                   tc->ack_th_valid ? tc->ack_th : 0);
+        memcpy(tc->ack_th, &tcp_ctl_pkt[IP_HEADER_LEN], TCP_HEADER_LEN);
+        tc->ack_th_valid = 1;
+    }
+    if (flags & TCP_FIN) tc->seq_num++;
+    tc->seq_num += data_len;
+}
+
+/* Sequence number just past a queued segment */
+unsigned long tcp_segment_end(struct tcp_segment *seg) {
+    return seg->seq + seg->len + ((seg->flags & TCP_FIN) ? 1 : 0);
+}
+
+/* Send a queued segment, or send it again from the header it went out with */
+void tcp_send_segment(struct tcp_conn *tc, struct tcp_segment *seg, unsigned char resend) {
+    unsigned char old_th[TCP_HEADER_LEN];
+    unsigned long end;
+
+    if (resend) {
+        memcpy(old_th, &seg->pkt[IP_HEADER_LEN], TCP_HEADER_LEN);
+    }
+    tcp_output(tc, seg->pkt, seg->seq, seg->flags, &seg->pkt[TCP_HEADROOM], seg->len,
+               resend ? old_th : 0);
+
+    end = tcp_segment_end(seg);
+    if (SEQ_LT(tc->seq_num, end)) {
+        tc->seq_num = end;
+    }
+}
+
+/* Fold a round-trip measurement into SRTT and RTTVAR and recompute the
+   timeout: RTO = SRTT + 4 * RTTVAR (RFC 6298) */
+void tcp_rtt_sample(struct tcp_conn *tc, long ticks) {
+    int rtt, delta;
+
+    /* Under a tick counts as one, which also keeps SRTT off 0 */
+    rtt = ticks > RTO_MAX ? RTO_MAX : ticks < 1 ? 1 : (int)ticks;
+    if (tc->srtt == 0) {
+        tc->srtt = rtt << 3;
+        tc->rttvar = rtt << 1;
+    } else {
+        delta = rtt - (tc->srtt >> 3);
+        tc->srtt += delta;
+        if (delta < 0) delta = -delta;
+        tc->rttvar += delta - (tc->rttvar >> 2);
     }
+    tc->rto = (tc->srtt >> 3) + tc->rttvar;
+    if (tc->rto < RTO_MIN) tc->rto = RTO_MIN;
+    if (tc->rto > RTO_MAX) tc->rto = RTO_MAX;
+    tc->rto_shift = 0;
+}
 
-    cksum = tcp_checksum(tcp_buf, tcp_len, local_ip, tcp_remote_ip);
-    put_u16(&tcp_buf[TCP_CHECKSUM], cksum);
+/* Send queued segments for as long as they fit the peer's window */
+void tcp_output_pending(struct tcp_conn *tc) {
+    struct tcp_segment *seg;
 
-    if (flags & TCP_SYN) tcp_seq_num++;
-    if (flags & TCP_FIN) tcp_seq_num++;
-    tcp_seq_num += data_len;
+    while (tc->sendq_sent < tc->sendq_count) {
+        seg = &tc->sendq[(tc->sendq_head + tc->sendq_sent) % TCP_SEND_SLOTS];
+        if (SEQ_LT(tc->last_ack + tc->snd_wnd, seg->seq + seg->len)) {
+            if (tc->sendq_sent == 0 && tc->persist_interval == 0) {
+                tc->persist_interval = PERSIST_MIN;
+                tc->persist_time = get_tick_count();
+            }
+            break;
+        }
+        tc->persist_interval = 0;
+        tcp_send_segment(tc, seg, 0);
+        if (tc->sendq_sent == 0) {
+            tc->retx_time = tcp_departure_time();
+            tc->retx_attempts = 0;
+        }
+        if (!tc->rtt_timing) {
+            tc->rtt_timing = 1;
+            tc->rtt_seq = tcp_segment_end(seg);
+            tc->rtt_start = tcp_departure_time();
+        }
+        tc->sendq_sent++;
+    }
+}
+
+/* Add the segment in the next free slot to the queue and send what fits */
+void tcp_queue_segment(struct tcp_conn *tc, unsigned char flags, unsigned short len) {
+    struct tcp_segment *seg = &tc->sendq[(tc->sendq_head + tc->sendq_count) % TCP_SEND_SLOTS];
 
-    ip_send(tcp_remote_ip, IP_PROTO_TCP, tcp_buf, (unsigned char)tcp_len);
+    if (tc->sendq_count == 0) {
+        seg->seq = tc->seq_num;
+    } else {
+        seg->seq = tcp_segment_end(
+            &tc->sendq[(tc->sendq_head + tc->sendq_count - 1) % TCP_SEND_SLOTS]);
+    }
+    seg->len = len;
+    seg->flags = flags;
+    tc->sendq_count++;
+    tcp_output_pending(tc);
 }
 
-void tcp_send(unsigned char *data, unsigned char len) {
-    if (tcp_state != TCP_STATE_ESTABLISHED) {
+/* Receive and dispatch a frame if one has arrived, and run the timers */
+/* Frames being handed up: the application's, and at most one more taken
+   for its ACKs while the application waits to send. Anything after that
+   stays in the ring until they are done. */
+unsigned char pkt_dispatching = 0;
+
+void net_poll(void) {
+    unsigned char *frame;
+    unsigned short len;
+
+    if (pkt_dispatching < 2 && slip_poll()) {
+        frame = slip_frame;
+        len = pkt_len;
+        pkt_len = 0;
+        if (!pkt_dispatching) {
+            slip_frame = (frame == pkt_buf) ? pkt_alt : pkt_buf;
+        }
+        pkt_dispatching++;
+        ip_receive(frame, len);
+        pkt_dispatching--;
+    }
+    tcp_check_retransmit();
+    if (conn_queue_count) {
+        conn_queue_expire();
+        tcp_process_queue();
+    }
+}
+
+/* The connection is open for the application to send on */
+#define TCP_CAN_SEND(tc) ((tc)->state == TCP_STATE_ESTABLISHED || \
+                          (tc)->state == TCP_STATE_CLOSE_WAIT)
+
+/* Whether a full segment can be queued and sent without waiting, either
+   for the peer or for the serial line. Filling the line no further than
+   this leaves the main loop free to take the ACKs coming back. */
+unsigned char tcp_tx_ready(unsigned char conn) {
+    struct tcp_conn *tc = &tcp_conns[conn];
+
+    return TCP_CAN_SEND(tc) && !tc->close_pending && tc->sendq_count < TCP_SEND_SLOTS &&
+           tx_free() >= SLIP_MAX_FRAME(TCP_HEADROOM + tc->snd_mss);
+}
+
+/* Wait for a free slot in the send queue and return where the next
+   payload byte goes, after any written with tcp_write (snd_mss - write_len
+   bytes fit), or 0 if the connection is not open for sending */
+unsigned char *tcp_tx_buffer(unsigned char conn) {
+    struct tcp_conn *tc = &tcp_conns[conn];
+
+    while (TCP_CAN_SEND(tc) && !tc->close_pending) {
+        if (tc->sendq_count < TCP_SEND_SLOTS) {
+            return &tc->sendq[(tc->sendq_head + tc->sendq_count) % TCP_SEND_SLOTS]
+                        .pkt[TCP_HEADROOM + tc->write_len];
+        }
+        net_poll();
+    }
+    return 0;
+}
+
+/* Our FIN is queued: wait for its ACK, or for the peer's FIN too */
+#define TCP_FIN_STATE(tc) ((tc)->state == TCP_STATE_CLOSE_WAIT ? \
+                           TCP_STATE_LAST_ACK : TCP_STATE_FIN_WAIT_1)
+
+/* Queue len bytes placed at tcp_tx_buffer(), along with any written in
+   front of them, closing the connection with a FIN on the same segment
+   if last is set */
+void tcp_queue_payload(unsigned char conn, unsigned short len, unsigned char last) {
+    struct tcp_conn *tc = &tcp_conns[conn];
+
+    if (!TCP_CAN_SEND(tc) || tc->close_pending || tc->sendq_count == TCP_SEND_SLOTS) {
         return;
     }
+    len += tc->write_len;
+    tc->write_len = 0;
+    tcp_bytes_sent += len;
+    if (last) {
+        tcp_queue_segment(tc, TCP_FIN | TCP_PSH | TCP_ACK, len);
+        tc->state = TCP_FIN_STATE(tc);
+    } else {
+        tcp_queue_segment(tc, TCP_PSH | TCP_ACK, len);
+    }
+}
 
-    /* Wait for previous data to be ACKed before sending more */
-    /* This implements simple stop-and-wait for reliability */
-    if (retx_len > 0) {
-        /* Previous send still pending - caller should retry later */
-        /* For now, we'll just send anyway (best effort) */
+/* Send len bytes already placed at tcp_tx_buffer() */
+void tcp_send_payload(unsigned char conn, unsigned short len) {
+    tcp_queue_payload(conn, len, 0);
+}
+
+/* Send the last len bytes at tcp_tx_buffer() and close */
+void tcp_send_last(unsigned char conn, unsigned short len) {
+    tcp_queue_payload(conn, len, 1);
+}
+
+/* Copy data into the send queue. Each segment is sent once snd_mss
+   bytes have collected; the rest waits for more or for tcp_flush. */
+void tcp_write(unsigned char conn, unsigned char *data, unsigned short len) {
+    struct tcp_conn *tc = &tcp_conns[conn];
+    unsigned char *buf;
+    unsigned short n;
+
+    while (len > 0) {
+        buf = tcp_tx_buffer(conn);
+        if (!buf) {
+            return;
+        }
+        n = tc->snd_mss - tc->write_len;
+        if (n > len) n = len;
+        memcpy(buf, data, n);
+        tcp_bytes_copied += n;
+        tc->write_len += n;
+        data += n;
+        len -= n;
+        if (tc->write_len == tc->snd_mss) {
+            tcp_queue_payload(conn, 0, 0);
+        }
     }
+}
+
+void tcp_write_str(unsigned char conn, char *s) {
+    tcp_write(conn, (unsigned char *)s, strlen(s));
+}
+
+/* Write n in decimal */
+void tcp_write_ulong(unsigned char conn, unsigned long n) {
+    char buf[10];
+    unsigned char i = sizeof(buf);
+
+    do {
+        buf[--i] = '0' + (unsigned char)(n % 10);
+        n /= 10;
+    } while (n > 0);
+    tcp_write(conn, (unsigned char *)&buf[i], sizeof(buf) - i);
+}
 
-    /* Save data for potential retransmission */
-    if (len <= RETX_BUF_SIZE) {
-        memcpy(retx_buf, data, len);
-        retx_len = len;
-        retx_seq = tcp_seq_num;  /* Sequence before sending */
-        retx_time = get_tick_count();
-        retx_attempts = 0;
+/* Send whatever tcp_write has collected */
+void tcp_flush(unsigned char conn) {
+    if (tcp_conns[conn].write_len > 0) {
+        tcp_queue_payload(conn, 0, 0);
     }
+}
+
+/* Whether the application expects nothing more on a connection for a
+   while, like one kept open for a client's next request. An idle one
+   leaves its share of the receive ring to the others. */
+void tcp_set_idle(unsigned char conn, unsigned char idle) {
+    tcp_conns[conn].rcv_idle = idle;
+}
 
-    tcp_send_flags(TCP_PSH | TCP_ACK, data, len);
+/* Copy data into the send queue and send it now */
+void tcp_send(unsigned char conn, unsigned char *data, unsigned short len) {
+    tcp_write(conn, data, len);
+    tcp_flush(conn);
 }
 
-void tcp_close(void) {
-    if (tcp_state == TCP_STATE_ESTABLISHED) {
-        tcp_state = TCP_STATE_FIN_WAIT_1;
-        tcp_send_flags(TCP_FIN | TCP_ACK, 0, 0);
+/* Queue a FIN behind any data still waiting to go, on the same segment
+   as any written but not yet sent. With the queue full it follows as
+   soon as a slot frees, so this never waits. */
+void tcp_close(unsigned char conn) {
+    struct tcp_conn *tc = &tcp_conns[conn];
+
+    if (!TCP_CAN_SEND(tc) || tc->close_pending) {
+        return;
+    }
+    if (tc->write_len > 0) {
+        tcp_queue_payload(conn, 0, 1);
+        return;
+    }
+    if (tc->sendq_count < TCP_SEND_SLOTS) {
+        tcp_queue_segment(tc, TCP_FIN | TCP_ACK, 0);
+    } else {
+        tc->close_pending = 1;
     }
-    retx_len = 0;  /* Clear retransmit buffer */
+    tc->state = TCP_FIN_STATE(tc);
 }
 
-/* Check for retransmission timeout - call from main loop */
-void tcp_check_retransmit(void) {
-    unsigned long now;
-    unsigned long saved_seq;
-
-    /* If stuck waiting for ACK of our SYN+ACK, time out and try next queued connection */
-    if (tcp_state == TCP_STATE_SYN_RECEIVED) {
-        now = get_tick_count();
-        if ((now - retx_time) >= RETX_TIMEOUT) {
-            tcp_state = TCP_STATE_LISTEN;
-            app_tcp_state_changed(TCP_STATE_SYN_RECEIVED, TCP_STATE_LISTEN,
-                                  tcp_remote_ip, tcp_remote_port);
-            tcp_process_queue();
+/* Ask for the peer's window with an ACK carrying a sequence number it
+   has already seen, which it has to answer */
+void tcp_send_window_probe(struct tcp_conn *tc) {
+    unsigned long saved_seq = tc->seq_num;
+
+    tc->seq_num = tc->last_ack - 1;
+    tcp_send_flags(tc, TCP_ACK, 0, 0);
+    tc->seq_num = saved_seq;
+    tcp_window_probes++;
+}
+
+/* Give up on the connection: reset it and free its slot */
+void tcp_abort(unsigned char conn) {
+    struct tcp_conn *tc = &tcp_conns[conn];
+
+    if (tc->state == TCP_STATE_CLOSED) {
+        return;
+    }
+    /* Only a RST at the edge of what the peer has received is taken at
+       once (RFC 5961); our unacknowledged data never got there */
+    tc->seq_num = tc->last_ack;
+    tcp_send_flags(tc, TCP_RST | TCP_ACK, 0, 0);
+    tcp_closed(tc);
+}
+
+/* Retransmit timeout for the next retry */
+unsigned short tcp_backoff_rto(struct tcp_conn *tc) {
+    unsigned long rto = (unsigned long)tc->rto << tc->rto_shift;
+
+    return rto > RTO_MAX ? RTO_MAX : (unsigned short)rto;
+}
+
+/* A retry is going out: count it, and double the timeout */
+void tcp_back_off(struct tcp_conn *tc) {
+    tc->retx_attempts++;
+    if (tc->rto_shift < RTO_MAX_SHIFT) {
+        tc->rto_shift++;
+    }
+}
+
+/* Send our SYN+ACK again and restart its timer */
+void tcp_resend_synack(struct tcp_conn *tc) {
+    tcp_back_off(tc);
+    tc->seq_num--;
+    tcp_send_flags(tc, TCP_SYN | TCP_ACK, 0, 0);
+    tcp_retransmits++;
+    tc->retx_time = tcp_departure_time();
+}
+
+/* Run one connection's timers */
+void tcp_conn_timers(struct tcp_conn *tc) {
+    unsigned long now = get_tick_count();
+    unsigned short step;
+
+    /* Our SYN+ACK hasn't been acknowledged: send it again with backoff,
+       then reset, so a peer whose ACK comes late isn't left hanging */
+    if (tc->state == TCP_STATE_SYN_RECEIVED) {
+        if ((long)(now - tc->retx_time) >= (long)tcp_backoff_rto(tc)) {
+            if (tc->retx_attempts >= RETX_MAX_ATTEMPTS) {
+                print_str("[Handshake timeout]\r\n");
+                tcp_idle_resets++;
+                tcp_send_flags(tc, TCP_RST | TCP_ACK, 0, 0);
+                tcp_closed(tc);
+            } else {
+                tcp_resend_synack(tc);
+            }
         }
         return;
     }
 
-    if (tcp_state != TCP_STATE_ESTABLISHED || retx_len == 0) {
+    if (tc->state == TCP_STATE_FIN_WAIT_2) {
+        if ((now - tc->heard_time) >= FIN_WAIT_TIMEOUT) {
+            print_str("[FIN timeout]\r\n");
+            tcp_idle_resets++;
+            tcp_abort(TCP_HANDLE(tc));
+        }
         return;
     }
 
-    now = get_tick_count();
+    if (tc->state != TCP_STATE_ESTABLISHED && tc->state != TCP_STATE_FIN_WAIT_1 &&
+        tc->state != TCP_STATE_CLOSE_WAIT && tc->state != TCP_STATE_CLOSING &&
+        tc->state != TCP_STATE_LAST_ACK) {
+        return;
+    }
 
-    /* Check if timeout exceeded (handle tick wraparound) */
-    if ((now - retx_time) >= RETX_TIMEOUT) {
-        retx_attempts++;
+    if ((now - tc->heard_time) >= IDLE_TIMEOUT) {
+        print_str("[Idle timeout]\r\n");
+        tcp_idle_resets++;
+        tcp_abort(TCP_HANDLE(tc));
+        return;
+    }
+
+    if (tc->ack_pending && (now - tc->ack_delay_time) >= DELACK_TICKS) {
+        tcp_send_flags(tc, TCP_ACK, 0, 0);
+        tcp_acks_delayed++;
+    }
+
+    /* The window we gave was too small for a full segment; say so once
+       it can grow by a segment or half this connection's share of the
+       ring, whichever is less (RFC 1122 receiver SWS avoidance) */
+    if (tc->state == TCP_STATE_ESTABLISHED && !tc->rcv_idle &&
+        SEQ_LT(tc->rcv_adv, tc->ack_num + TCP_MSS)) {
+        step = tcp_rx_payload(RX_BUF_SIZE - 1) / tcp_rx_sharers(tc) / 2;
+        if (step > TCP_MSS) {
+            step = TCP_MSS;
+        }
+        if (SEQ_LEQ(tc->rcv_adv + step, tc->ack_num + tcp_rx_room(tc))) {
+            tcp_send_flags(tc, TCP_ACK, 0, 0);
+            tcp_window_updates++;
+        }
+    }
+
+    /* Window closed with nothing in flight: probe, backing off up to
+       PERSIST_MAX. The idle timer ends it if the window never opens. */
+    if (tc->persist_interval) {
+        if ((now - tc->persist_time) >= tc->persist_interval) {
+            tcp_send_window_probe(tc);
+            tc->persist_time = now;
+            tc->persist_interval = tc->persist_interval < PERSIST_MAX / 2 ?
+                                   tc->persist_interval * 2 : PERSIST_MAX;
+        }
+        return;
+    }
+
+    if (tc->sendq_sent == 0) {
+        return;
+    }
 
-        if (retx_attempts > RETX_MAX_ATTEMPTS) {
+    /* Check if timeout exceeded (handle tick wraparound), doubling it
+       for each retry. retx_time may still lie ahead. */
+    if ((long)(now - tc->retx_time) >= (long)tcp_backoff_rto(tc)) {
+        tcp_back_off(tc);
+
+        if (tc->retx_attempts > RETX_MAX_ATTEMPTS) {
             /* Give up - connection probably dead */
             print_str("[Retransmit failed]\r\n");
-            retx_len = 0;
+            tcp_abort(TCP_HANDLE(tc));
             return;
         }
 
-        print_str("[Retransmit #"); print_uint(retx_attempts); print_str("]\r\n");
+        print_str("[Retransmit #"); print_uint(tc->retx_attempts); print_str("]\r\n");
+
+        /* Resend from the oldest unacknowledged byte; the ACK for it says
+           whether anything later is missing too */
+        tcp_send_segment(tc, &tc->sendq[tc->sendq_head], 1);
+        tcp_retransmits++;
+        tc->rtt_timing = 0;  /* Karn: an ACK now can't say which copy it is for */
+
+        tc->retx_time = tcp_departure_time();  /* Reset timeout */
+    }
+}
+
+/* Check every connection for timeouts - call from main loop */
+void tcp_check_retransmit(void) {
+    unsigned char i;
+
+    for (i = 0; i < TCP_MAX_CONNS; i++) {
+        if (tcp_conns[i].state != TCP_STATE_CLOSED) {
+            tcp_conn_timers(&tcp_conns[i]);
+        }
+    }
+}
+
+/* The MSS option from a peer's SYN, or the default if it sent none.
+   Never more than fits our own packets. */
+unsigned short tcp_parse_mss(unsigned char *pkt, unsigned char hdr_len) {
+    unsigned short mss = TCP_DEFAULT_MSS;
+    unsigned char i = TCP_HEADER_LEN;
+
+    while (i < hdr_len && pkt[i] != TCP_OPT_END) {
+        if (pkt[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= hdr_len || pkt[i + 1] < 2 || i + pkt[i + 1] > hdr_len) {
+            break;  /* Malformed */
+        }
+        if (pkt[i] == TCP_OPT_MSS && pkt[i + 1] == TCP_MSS_OPT_LEN) {
+            mss = get_u16(&pkt[i + 2]);
+        }
+        i += pkt[i + 1];
+    }
+    if (mss == 0) mss = TCP_DEFAULT_MSS;
+    if (mss > TCP_MSS) mss = TCP_MSS;
+    return mss;
+}
+
+/* Take the peer's cumulative ACK and window: drop the segments it covers
+   and send whatever the window now allows */
+void tcp_ack_received(struct tcp_conn *tc, unsigned long ack_num, unsigned short window,
+                      unsigned short data_len) {
+    struct tcp_segment *seg;
+
+    if (SEQ_LT(ack_num, tc->last_ack) || SEQ_LT(tc->seq_num, ack_num)) {
+        return;  /* Old, or for data not yet sent */
+    }
+
+    /* A duplicate carries nothing new at all, while data is outstanding */
+    if (SEQ_EQ(ack_num, tc->last_ack) && data_len == 0 &&
+        window == tc->snd_wnd && tc->sendq_sent > 0) {
+        if (++tc->dup_acks == DUP_ACK_THRESHOLD) {
+            tcp_send_segment(tc, &tc->sendq[tc->sendq_head], 1);
+            tcp_fast_retransmits++;
+            tc->rtt_timing = 0;
+            tc->retx_time = tcp_departure_time();
+        }
+        return;
+    }
+    tc->snd_wnd = window;
+
+    if (SEQ_LT(tc->last_ack, ack_num)) {
+        tc->last_ack = ack_num;
+        while (tc->sendq_sent > 0) {
+            seg = &tc->sendq[tc->sendq_head];
+            if (SEQ_LT(ack_num, tcp_segment_end(seg))) {
+                break;
+            }
+            tc->sendq_head = (tc->sendq_head + 1) % TCP_SEND_SLOTS;
+            tc->sendq_count--;
+            tc->sendq_sent--;
+        }
+        if (tc->rtt_timing && SEQ_LEQ(tc->rtt_seq, ack_num)) {
+            tc->rtt_timing = 0;
+            tcp_rtt_sample(tc, (long)(get_tick_count() - tc->rtt_start));
+        }
+        tc->retx_time = tcp_departure_time();
+        tc->retx_attempts = 0;
+        tc->dup_acks = 0;
+    }
+    if (tc->close_pending && tc->sendq_count < TCP_SEND_SLOTS) {
+        tc->close_pending = 0;
+        tcp_queue_segment(tc, TCP_FIN | TCP_ACK, 0);
+    }
+    tcp_output_pending(tc);
+}
+
+/* Everything we queued, FIN included, has been acknowledged */
+#define TCP_ALL_ACKED(tc) ((tc)->sendq_count == 0 && !(tc)->close_pending)
 
-        /* Rewind sequence number and resend */
-        saved_seq = tcp_seq_num;
-        tcp_seq_num = retx_seq;
-        tcp_send_flags(TCP_PSH | TCP_ACK, retx_buf, retx_len);
-        /* tcp_send_flags already advances tcp_seq_num */
+/* Hand received data to the application. Returns 0 if the connection
+   was reset or taken over meanwhile. */
+unsigned char tcp_deliver(struct tcp_conn *tc, unsigned char *data, unsigned short len) {
+    unsigned char state = tc->state;
 
-        retx_time = now;  /* Reset timeout */
+    tcp_app_busy = 1;
+    app_tcp_data_received(TCP_HANDLE(tc), data, len);
+    tcp_app_busy = 0;
+    return tc->state == state || tc->state == TCP_STATE_FIN_WAIT_1 ||
+           tc->state == TCP_STATE_LAST_ACK;
+}
+
+/* Take the next len bytes in sequence. They are acknowledged once the
+   application has them, so the window in the ACK allows for however
+   long it took. The ACK waits for a segment of ours to ride on, except
+   that every second segment is acknowledged at once, as is data that
+   fills a gap. Returns 0 if the connection was reset meanwhile. */
+unsigned char tcp_take_data(struct tcp_conn *tc, unsigned char *data, unsigned short len) {
+    unsigned char unacked = tc->ack_pending;
+    struct tcp_ooo_seg *os;
+    unsigned short skip;
+
+    tc->ack_num += len;
+    if (!unacked) {
+        tc->ack_pending = 1;
+        tc->ack_delay_time = get_tick_count();
     }
+    if (!tcp_deliver(tc, data, len)) {
+        return 0;
+    }
+
+    /* Held segments the gap was in front of follow on. Data arriving
+       while the application has one is turned away, so the slot can be
+       freed first. */
+    while ((os = tcp_ooo_next(TCP_HANDLE(tc), tc->ack_num)) != 0) {
+        os->valid = 0;
+        skip = (unsigned short)(tc->ack_num - os->seq);
+        if (skip >= os->len) {
+            continue;
+        }
+        tc->ack_num += os->len - skip;
+        unacked = 1;
+        if (!tcp_deliver(tc, os->data + skip, os->len - skip)) {
+            return 0;
+        }
+    }
+
+    if (unacked && tc->ack_pending) {
+        tcp_send_flags(tc, TCP_ACK, 0, 0);
+    }
+    return 1;
 }
 
 void tcp_receive(unsigned char *pkt, unsigned short len, unsigned long src_ip) {
+    struct tcp_conn *tc;
+    struct pending_conn *queued;
+    unsigned char *data;
     unsigned short src_port, dst_port;
     unsigned long seq_num, ack_num;
     unsigned char data_off, flags, hdr_len;
-    unsigned short data_len;
-    unsigned char old_state;
+    unsigned short data_len, window;
 
     if (len < TCP_HEADER_LEN) return;
 
@@ -751,119 +2119,218 @@ void tcp_receive(unsigned char *pkt, unsigned short len, unsigned long src_ip) {
     ack_num = get_u32(&pkt[TCP_ACK_OFF]);
     data_off = pkt[TCP_DATA_OFF];
     flags = pkt[TCP_FLAGS];
+    window = get_u16(&pkt[TCP_WINDOW]);
 
     hdr_len = (data_off >> 4) * 4;
     if (hdr_len < TCP_HEADER_LEN || hdr_len > len) return;
 
     data_len = len - hdr_len;
+    data = &pkt[hdr_len];
 
     if (dst_port != tcp_local_port) return;
 
-    /* Queue SYNs if we're busy (not in LISTEN state) */
-    if ((flags & TCP_SYN) && !(flags & TCP_ACK) && tcp_state != TCP_STATE_LISTEN) {
-        conn_queue_add(src_ip, src_port, seq_num);
-        print_str("[Queued: "); print_uint(conn_queue_count); print_str(" pending]\r\n");
+    tc = tcp_find(src_ip, src_port);
+    if (!tc) {
+        /* A new connection gets a free slot, or waits in the queue. Slots
+           are not handed out while the application is busy, so one it is
+           sending on can't change hands under it. */
+        if ((flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN) {
+            tc = (tcp_app_busy || conn_queue_count) ? 0 : tcp_find_free();
+            if (tc) {
+                struct pending_conn pc;
+
+                pc.remote_ip = src_ip;
+                pc.remote_port = src_port;
+                pc.their_seq = seq_num;
+                pc.their_mss = tcp_parse_mss(pkt, hdr_len);
+                pc.their_window = window;
+                pc.synack_sent = 0;
+                pc.acked = 0;
+                tcp_accept(tc, &pc);
+            } else {
+                conn_queue_add(src_ip, src_port, seq_num, tcp_parse_mss(pkt, hdr_len), window);
+                print_str("[Queued: "); print_uint(conn_queue_count); print_str(" pending]\r\n");
+            }
+        } else if ((queued = conn_queue_find(src_ip, src_port)) != 0) {
+            conn_queue_segment(queued, flags, ack_num, window);
+        } else if ((flags & (TCP_FIN | TCP_ACK | TCP_RST)) == (TCP_FIN | TCP_ACK)) {
+            /* From a peer whose slot went to the backlog once our FIN was
+               acknowledged, so its ACK tells us where we are */
+            tcp_reply(src_ip, src_port, ack_num, seq_num + data_len + 1, TCP_ACK);
+        }
         return;
     }
 
+    /* Anything new from the peer holds off the idle timer */
+    if (data_len > 0 || (flags & TCP_FIN) ||
+        ((flags & TCP_ACK) && SEQ_LT(tc->last_ack, ack_num))) {
+        tc->heard_time = get_tick_count();
+    }
+
+    /* Header prediction: while established, nearly every segment is the
+       next one in sequence from our peer with only ACK (and maybe PSH)
+       set - either a pure ACK of our data or in-order data */
+    if (tc->state == TCP_STATE_ESTABLISHED &&
+        (flags & (TCP_SYN | TCP_FIN | TCP_RST | TCP_URG | TCP_ACK)) == TCP_ACK &&
+        SEQ_EQ(seq_num, tc->ack_num)) {
+        if (data_len == 0) {
+            tcp_ack_received(tc, ack_num, window, data_len);
+            tcp_fast_acks++;
+            return;
+        }
+        if (SEQ_EQ(ack_num, tc->last_ack) && !tcp_app_busy) {
+            tc->snd_wnd = window;
+            tcp_take_data(tc, data, data_len);
+            tcp_fast_data++;
+            return;
+        }
+    }
+    tcp_slow_path++;
+
     /* Handle RST */
     if (flags & TCP_RST) {
-        if (tcp_state != TCP_STATE_CLOSED && tcp_state != TCP_STATE_LISTEN) {
-            old_state = tcp_state;
-            tcp_state = TCP_STATE_LISTEN;
-            app_tcp_state_changed(old_state, tcp_state, tcp_remote_ip, tcp_remote_port);
-            tcp_process_queue();
+        tcp_closed(tc);
+        return;
+    }
+
+    /* Our SYN+ACK was lost and the peer is trying again */
+    if ((flags & (TCP_SYN | TCP_ACK)) == TCP_SYN) {
+        if (tc->state == TCP_STATE_SYN_RECEIVED) {
+            tcp_resend_synack(tc);
         }
         return;
     }
 
-    old_state = tcp_state;
-
-    switch (tcp_state) {
-    case TCP_STATE_LISTEN:
-        if (flags & TCP_SYN) {
-            if (app_tcp_accept(src_ip, src_port)) {
-                tcp_remote_ip = src_ip;
-                tcp_remote_port = src_port;
-                tcp_seq_num = 1000;
-                tcp_ack_num = seq_num + 1;
-                tcp_send_flags(TCP_SYN | TCP_ACK, 0, 0);
-                tcp_state = TCP_STATE_SYN_RECEIVED;
-                retx_time = get_tick_count();
-                app_tcp_state_changed(old_state, tcp_state, src_ip, src_port);
-            }
+    /* The application is still busy with earlier data, so anything new
+       for it is left unacknowledged for the peer to send again. A bare FIN
+       after ours needs nothing from it and ends the connection now. */
+    if (tcp_app_busy && (data_len > 0 ||
+                         ((flags & TCP_FIN) && (tc->state == TCP_STATE_ESTABLISHED ||
+                                                tc->state == TCP_STATE_CLOSE_WAIT)))) {
+        if ((flags & TCP_ACK) && tc->state != TCP_STATE_SYN_SENT &&
+            tc->state != TCP_STATE_SYN_RECEIVED) {
+            tcp_ack_received(tc, ack_num, window, data_len);
         }
-        break;
+        return;
+    }
 
+    switch (tc->state) {
     case TCP_STATE_SYN_SENT:
         if ((flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK)) {
-            tcp_ack_num = seq_num + 1;
-            tcp_last_ack = ack_num;
-            tcp_state = TCP_STATE_ESTABLISHED;
-            tcp_send_flags(TCP_ACK, 0, 0);
-            app_tcp_state_changed(old_state, tcp_state, tcp_remote_ip, tcp_remote_port);
+            tc->ack_num = seq_num + 1;
+            tc->rcv_adv = tc->ack_num;
+            tc->last_ack = ack_num;
+            tc->snd_wnd = window;
+            tcp_send_flags(tc, TCP_ACK, 0, 0);
+            tcp_set_state(tc, TCP_STATE_ESTABLISHED);
         }
         break;
 
     case TCP_STATE_SYN_RECEIVED:
-        if (flags & TCP_ACK) {
-            tcp_last_ack = ack_num;
-            tcp_state = TCP_STATE_ESTABLISHED;
-            app_tcp_state_changed(old_state, tcp_state, tcp_remote_ip, tcp_remote_port);
+        if ((flags & TCP_ACK) && SEQ_EQ(ack_num, tc->seq_num)) {
+            tc->last_ack = ack_num;
+            tc->snd_wnd = window;
+            if (tc->retx_attempts == 0) {
+                /* Karn: only a SYN+ACK sent once can be timed */
+                tcp_rtt_sample(tc, (long)(get_tick_count() - tc->retx_time));
+            }
+            tc->retx_attempts = 0;
+            tcp_set_state(tc, TCP_STATE_ESTABLISHED);
         }
         break;
 
     case TCP_STATE_ESTABLISHED:
         if (flags & TCP_ACK) {
-            tcp_last_ack = ack_num;
-            /* Check if this ACK covers our retransmit buffer */
-            if (retx_len > 0 && ack_num >= retx_seq + retx_len) {
-                retx_len = 0;  /* Data acknowledged, clear buffer */
+            tcp_ack_received(tc, ack_num, window, data_len);
+        }
+        if (data_len > 0 && SEQ_LT(seq_num, tc->ack_num) &&
+            SEQ_LT(tc->ack_num, seq_num + data_len)) {
+            /* Sent again with more on the end: take only the new part */
+            data += (unsigned short)(tc->ack_num - seq_num);
+            data_len -= (unsigned short)(tc->ack_num - seq_num);
+            seq_num = tc->ack_num;
+        }
+        if (!SEQ_EQ(seq_num, tc->ack_num)) {
+            /* A copy of what we have - most likely sent again while our
+               ACK waited behind other data - or beyond a gap, kept if
+               there is room. Empty ones are keepalives or window probes
+               (RFC 793 wants those answered too). Either way the ACK
+               says what we need. */
+            if (SEQ_LT(seq_num, tc->ack_num)) {
+                if (data_len > 0 || (flags & TCP_FIN)) {
+                    tcp_rx_dups++;
+                }
+            } else if (data_len > 0) {
+                tcp_ooo_store(TCP_HANDLE(tc), seq_num, data, data_len);
             }
+            tcp_send_flags(tc, TCP_ACK, 0, 0);
+            break;
         }
-        if (data_len > 0) {
-            tcp_ack_num = seq_num + data_len;
-            tcp_send_flags(TCP_ACK, 0, 0);
-            app_tcp_data_received(&pkt[hdr_len], data_len);
+        if (data_len > 0 && !tcp_take_data(tc, data, data_len)) {
+            break;  /* Reset while the application was sending */
         }
         if (flags & TCP_FIN) {
-            tcp_ack_num = seq_num + data_len + 1;
-            tcp_send_flags(TCP_FIN | TCP_ACK, 0, 0);
-            tcp_state = TCP_STATE_LISTEN;
-            app_tcp_state_changed(old_state, tcp_state, tcp_remote_ip, tcp_remote_port);
-            tcp_process_queue();
+            tc->ack_num = seq_num + data_len + 1;
+            tcp_send_flags(tc, TCP_ACK, 0, 0);
+            if (tc->state == TCP_STATE_ESTABLISHED) {
+                /* The application may still be sending; it closes when done */
+                tcp_set_state(tc, TCP_STATE_CLOSE_WAIT);
+            } else if (TCP_ALL_ACKED(tc)) {
+                tcp_closed(tc);
+            } else {
+                tc->state = TCP_STATE_CLOSING;  /* Our FIN is still queued */
+            }
         }
         break;
 
     case TCP_STATE_FIN_WAIT_1:
         if (flags & TCP_ACK) {
-            tcp_last_ack = ack_num;
-            tcp_state = TCP_STATE_FIN_WAIT_2;
+            tcp_ack_received(tc, ack_num, window, data_len);
+            if (TCP_ALL_ACKED(tc)) {
+                tc->state = TCP_STATE_FIN_WAIT_2;  /* Our FIN is acknowledged */
+            }
         }
-        if (flags & TCP_FIN) {
-            tcp_ack_num = seq_num + 1;
-            tcp_send_flags(TCP_ACK, 0, 0);
-            tcp_state = TCP_STATE_LISTEN;
-            app_tcp_state_changed(old_state, tcp_state, tcp_remote_ip, tcp_remote_port);
-            tcp_process_queue();
+        if (!SEQ_EQ(seq_num, tc->ack_num)) {
+            tcp_send_flags(tc, TCP_ACK, 0, 0);  /* Missing data, or a keepalive */
+        } else if (flags & TCP_FIN) {
+            /* Any data with it is dropped - the application has closed */
+            tc->ack_num = seq_num + data_len + 1;
+            tcp_send_flags(tc, TCP_ACK, 0, 0);
+            if (TCP_ALL_ACKED(tc)) {
+                tcp_closed(tc);
+            } else {
+                tc->state = TCP_STATE_CLOSING;
+            }
         }
         break;
 
     case TCP_STATE_FIN_WAIT_2:
+        if (!SEQ_EQ(seq_num, tc->ack_num)) {
+            tcp_send_flags(tc, TCP_ACK, 0, 0);
+        } else if (flags & TCP_FIN) {
+            tc->ack_num = seq_num + data_len + 1;
+            tcp_send_flags(tc, TCP_ACK, 0, 0);
+            tcp_closed(tc);
+        }
+        break;
+
+    case TCP_STATE_CLOSE_WAIT:
+    case TCP_STATE_CLOSING:
+    case TCP_STATE_LAST_ACK:
+        if (flags & TCP_ACK) {
+            tcp_ack_received(tc, ack_num, window, data_len);
+        }
         if (flags & TCP_FIN) {
-            tcp_ack_num = seq_num + 1;
-            tcp_send_flags(TCP_ACK, 0, 0);
-            tcp_state = TCP_STATE_LISTEN;
-            app_tcp_state_changed(old_state, tcp_state, tcp_remote_ip, tcp_remote_port);
-            tcp_process_queue();
+            tcp_send_flags(tc, TCP_ACK, 0, 0);  /* Our ACK of it was lost */
+        }
+        if (tc->state != TCP_STATE_CLOSE_WAIT && TCP_ALL_ACKED(tc)) {
+            tcp_closed(tc);
         }
         break;
     }
 }
 
-/* Connect to remote host (client mode) */
 /* Start listening (server mode) */
 void tcp_listen(unsigned short port) {
     tcp_local_port = port;
-    tcp_state = TCP_STATE_LISTEN;
 }
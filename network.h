@@ -47,6 +47,13 @@ extern unsigned long local_ip;
 #define TCP_URGENT      18
 #define TCP_HEADER_LEN  20
 
+/* TCP options */
+#define TCP_OPT_END     0
+#define TCP_OPT_NOP     1
+#define TCP_OPT_MSS     2
+#define TCP_MSS_OPT_LEN 4
+#define TCP_DEFAULT_MSS 536  /* Assumed when a SYN carries no MSS (RFC 879) */
+
 /* TCP flags */
 #define TCP_FIN  0x01
 #define TCP_SYN  0x02
@@ -55,6 +62,11 @@ extern unsigned long local_ip;
 #define TCP_ACK  0x10
 #define TCP_URG  0x20
 
+/* Sequence number comparisons, modulo 2^32 even where long is wider */
+#define SEQ_EQ(a, b)  ((((a) - (b)) & 0xFFFFFFFFUL) == 0)
+#define SEQ_LT(a, b)  ((((a) - (b)) & 0x80000000UL) != 0)
+#define SEQ_LEQ(a, b) (SEQ_EQ(a, b) || SEQ_LT(a, b))
+
 /* TCP connection states (superset for client and server) */
 #define TCP_STATE_CLOSED       0
 #define TCP_STATE_LISTEN       1
@@ -65,6 +77,8 @@ extern unsigned long local_ip;
 #define TCP_STATE_FIN_WAIT_2   6
 #define TCP_STATE_CLOSING      7
 #define TCP_STATE_TIME_WAIT    8
+#define TCP_STATE_CLOSE_WAIT   9
+#define TCP_STATE_LAST_ACK     10
 
 /* SLIP constants */
 #define SLIP_END     0xC0
@@ -73,8 +87,23 @@ extern unsigned long local_ip;
 #define SLIP_ESC_ESC 0xDD
 
 /* Buffer sizes */
-#define RX_BUF_SIZE  256
+#define RX_BUF_SIZE  1024  /* Must be a power of two */
 #define PKT_BUF_SIZE 576  /* Standard SLIP MTU */
+#define TX_QUEUE_SIZE 2048  /* Must be a power of two, > SLIP_MAX_FRAME(PKT_BUF_SIZE) */
+
+/* Largest TCP payload that fits an MTU-sized packet */
+#define TCP_MSS (PKT_BUF_SIZE - IP_HEADER_LEN - TCP_HEADER_LEN)
+
+/* Connections served at once, and segments each keeps in flight */
+#define TCP_MAX_CONNS  4
+#define TCP_SEND_SLOTS 4
+
+/* UART divisor for a baud rate (1.8432 MHz clock) */
+#define BAUD_DIVISOR(baud) ((unsigned short)(115200UL / (baud)))
+#define DIVISOR_BAUD(div)  (115200UL / (div))
+
+/* Worst-case encoded size of a SLIP frame (every byte escaped) */
+#define SLIP_MAX_FRAME(len) (2 * (unsigned short)(len) + 2)
 
 /*============================================================================
  * Global Variables (defined in network.c)
@@ -84,34 +113,148 @@ extern unsigned long local_ip;
 extern unsigned char pkt_buf[];
 extern unsigned short pkt_len;
 
+/* Outgoing TCP segments - write up to snd_mss bytes at tcp_tx_buffer()
+   and send them with tcp_send_payload, or tcp_send_last to put the FIN on
+   the same segment; the headers go in front without a copy. Segments
+   stay queued until acknowledged. Small writes with tcp_write collect in
+   the same place until a segment is full or tcp_flush sends it, and data
+   placed at tcp_tx_buffer() follows on after them. */
+#define TCP_HEADROOM (IP_HEADER_LEN + TCP_HEADER_LEN)
+
+/* A send queue slot holds one segment with room for its headers in front
+   of the payload. It stays put until the peer acknowledges it and doubles
+   as the retransmit copy. */
+struct tcp_segment {
+    unsigned char  pkt[TCP_HEADROOM + TCP_MSS];
+    unsigned long  seq;              /* Sequence number of the first byte */
+    unsigned short len;              /* Payload bytes */
+    unsigned char  flags;            /* PSH|ACK, or FIN|ACK for the close */
+};
+
+/* One connection. Applications refer to it by its index in tcp_conns,
+   which is the handle passed to the callbacks. */
+struct tcp_conn {
+    unsigned char  state;
+    unsigned long  remote_ip;
+    unsigned short remote_port;
+    unsigned long  seq_num;          /* Next sequence number to send */
+    unsigned long  ack_num;          /* Next sequence number expected */
+    unsigned long  last_ack;         /* Oldest unacknowledged sequence number */
+    unsigned short snd_wnd;          /* Peer's advertised window */
+    unsigned short snd_mss;          /* Peer's MSS, capped at TCP_MSS */
+    unsigned long  pseudo_base;      /* Pseudo-header sum, less the TCP length */
+
+    /* Send queue: sendq_count segments from sendq_head, of which the
+       first sendq_sent have gone out */
+    struct tcp_segment sendq[TCP_SEND_SLOTS];
+    unsigned char  sendq_head;
+    unsigned char  sendq_count;
+    unsigned char  sendq_sent;
+    unsigned char  close_pending;    /* FIN waits for a free slot */
+    unsigned short write_len;        /* Bytes written to the next slot, not yet queued */
+
+    /* Last header-only segment sent, to checksum the next from */
+    unsigned char  ack_th[TCP_HEADER_LEN];
+    unsigned char  ack_th_valid;
+
+    /* Retransmission and round-trip timing */
+    unsigned long  retx_time;        /* When the oldest segment was sent */
+    unsigned char  retx_attempts;    /* Retries of the oldest segment */
+    unsigned char  rto_shift;        /* Timeouts since RTO was last measured */
+    unsigned short srtt;             /* Smoothed RTT in ticks x 8, 0 until measured */
+    unsigned short rttvar;           /* RTT variation in ticks x 4 */
+    unsigned short rto;              /* Retransmit timeout in ticks */
+    unsigned char  rtt_timing;       /* A segment is being timed */
+    unsigned long  rtt_seq;          /* ACK that ends the measurement */
+    unsigned long  rtt_start;
+    unsigned char  dup_acks;
+
+    /* Persist timer, 0 interval while the window is open */
+    unsigned long  persist_time;
+    unsigned short persist_interval;
+
+    /* Received data not yet acknowledged, and since when */
+    unsigned char  ack_pending;
+    unsigned long  ack_delay_time;
+    unsigned long  rcv_adv;          /* Right edge of the window last advertised */
+    unsigned char  rcv_idle;         /* No data expected soon, so no share of the ring */
+
+    /* When the peer last sent data or acknowledged ours */
+    unsigned long  heard_time;
+};
+
+extern unsigned long tcp_bytes_sent;
+extern unsigned long tcp_bytes_copied;
+extern unsigned short tcp_retransmits;
+extern unsigned short tcp_fast_retransmits;
+extern unsigned short tcp_window_probes;
+
+/* Received segments handled by header prediction, and all the others */
+extern unsigned short tcp_fast_acks;
+extern unsigned short tcp_fast_data;
+extern unsigned short tcp_slow_path;
+
+/* Received data acknowledged with our own data, and by the timer */
+extern unsigned short tcp_acks_piggybacked;
+extern unsigned short tcp_acks_delayed;
+
+/* Window updates sent once receive space freed up */
+extern unsigned short tcp_window_updates;
+
+/* Segments received again, and held because they came ahead of a gap */
+extern unsigned short tcp_rx_dups;
+extern unsigned short tcp_rx_ooo;
+
+/* Connections reset for making no progress */
+extern unsigned short tcp_idle_resets;
+
 /* TCP state */
-extern unsigned char tcp_state;
-extern unsigned long tcp_remote_ip;
+extern struct tcp_conn tcp_conns[];
 extern unsigned short tcp_local_port;
-extern unsigned short tcp_remote_port;
-extern unsigned long tcp_seq_num;
-extern unsigned long tcp_ack_num;
-extern unsigned long tcp_last_ack;
+extern unsigned char tcp_early_synack;  /* Handshake with queued clients */
+extern unsigned char conn_queue_count;  /* Clients waiting for a slot */
 
 /*============================================================================
  * Function Declarations
  *============================================================================*/
 
 /* Serial layer */
-void init_serial(void);
+extern unsigned short serial_divisor;
+extern unsigned char flow_control;       /* Set before init_serial */
+extern unsigned char uart_fifo;
+extern volatile unsigned short rx_overflows;
+extern volatile unsigned short uart_overruns;
+extern volatile unsigned short uart_frame_errors;
+void init_serial(unsigned short divisor);
+void set_baud_divisor(unsigned short divisor);
 void cleanup_serial(void);
 unsigned char rx_available(void);
 unsigned char rx_getchar(void);
 void tx_putchar(unsigned char c);
+unsigned short tx_free(void);
+void tx_flush(void);
 
 /* SLIP layer */
 unsigned char slip_poll(void);
-void slip_send(unsigned char *data, unsigned char len);
+unsigned char slip_queue(unsigned char *data, unsigned short len);
+unsigned char slip_queue_packet(unsigned char *hdr, unsigned char hdr_len,
+                                unsigned char *data, unsigned short data_len,
+                                unsigned char cksum_off, unsigned long sum);
+void slip_send(unsigned char *data, unsigned short len);
+unsigned char slip_autobaud(unsigned long peer_ip);
+
+/* Header compression (CSLIP, RFC 1144) */
+extern unsigned char cslip_enabled;
+extern unsigned short vj_tx_compressed;
+extern unsigned short vj_rx_compressed;
+extern unsigned short vj_rx_errors;
 
 /* IP layer */
 void ip_receive(unsigned char *pkt, unsigned short len);
+void ip_build_header(unsigned char *hdr, unsigned long dst_ip,
+                     unsigned char protocol, unsigned short payload_len);
 void ip_send(unsigned long dst_ip, unsigned char protocol,
-             unsigned char *payload, unsigned char payload_len);
+             unsigned char *payload, unsigned short payload_len);
 
 /* Console output */
 void print_char(char c);
@@ -120,32 +263,56 @@ void print_uint(unsigned short n);
 void print_ulong(unsigned long n);
 
 /* Helper functions */
+unsigned long checksum_add(unsigned long sum, unsigned char *data, unsigned short len);
+unsigned long checksum_add_c(unsigned long sum, unsigned char *data, unsigned short len);
+unsigned short checksum_fold(unsigned long sum);
 unsigned short checksum(unsigned char *data, unsigned short len);
+unsigned short checksum_adjust(unsigned short cksum, unsigned short old_word,
+                               unsigned short new_word);
 unsigned short get_u16(unsigned char *p);
 void put_u16(unsigned char *p, unsigned short val);
 unsigned long get_u32(unsigned char *p);
 void put_u32(unsigned char *p, unsigned long val);
 void print_ip(unsigned long ip);
 unsigned long parse_ip(char *s);
+unsigned long get_tick_count(void);
 
 /* TCP layer */
+unsigned long tcp_pseudo_sum(unsigned long src_ip, unsigned long dst_ip,
+                             unsigned short tcp_len);
 unsigned short tcp_checksum(unsigned char *tcp_pkt, unsigned short tcp_len,
                             unsigned long src_ip, unsigned long dst_ip);
-void tcp_send_flags(unsigned char flags, unsigned char *data, unsigned char data_len);
-void tcp_send(unsigned char *data, unsigned char len);
-void tcp_close(void);
+void tcp_set_remote(unsigned char conn, unsigned long ip, unsigned short port);
+void tcp_send_flags(struct tcp_conn *tc, unsigned char flags,
+                    unsigned char *data, unsigned short data_len);
+void tcp_send(unsigned char conn, unsigned char *data, unsigned short len);
+unsigned char tcp_tx_ready(unsigned char conn);
+unsigned char *tcp_tx_buffer(unsigned char conn);  /* Waits for send space; 0 if closed */
+void tcp_send_payload(unsigned char conn, unsigned short len);
+void tcp_send_last(unsigned char conn, unsigned short len);  /* ... with FIN */
+void tcp_write(unsigned char conn, unsigned char *data, unsigned short len);
+void tcp_write_str(unsigned char conn, char *s);
+void tcp_write_ulong(unsigned char conn, unsigned long n);
+void tcp_flush(unsigned char conn);
+void tcp_set_idle(unsigned char conn, unsigned char idle);
+void tcp_close(unsigned char conn);
+void tcp_abort(unsigned char conn);
 void tcp_listen(unsigned short port);
-void tcp_check_retransmit(void);  /* Call from main loop */
+void tcp_check_retransmit(void);
+
+/* Receive one frame and run the timers - call from main loop */
+void net_poll(void);
 
 /*============================================================================
  * Application Callbacks (implement in your app)
  *============================================================================*/
 
 /* Called when TCP data is received in ESTABLISHED state */
-void app_tcp_data_received(unsigned char *data, unsigned short len);
+void app_tcp_data_received(unsigned char conn, unsigned char *data, unsigned short len);
 
-/* Called when TCP connection state changes */
-void app_tcp_state_changed(unsigned char old_state, unsigned char new_state,
+/* Called when TCP connection state changes; CLOSED frees the handle */
+void app_tcp_state_changed(unsigned char conn, unsigned char old_state,
+                           unsigned char new_state,
                            unsigned long remote_ip, unsigned short remote_port);
 
 /* Called to check if we should accept an incoming SYN (server mode) */
@@ -0,0 +1,355 @@
+/* pal_dos.c - Platform layer for the Atari Portfolio (UART, interrupts, BIOS timer) */
+
+#include "network.h"
+#include "platform.h"
+
+/*============================================================================
+ * UART Definitions
+ *============================================================================*/
+
+#define RBR 0  /* Receiver Buffer Register (read) */
+#define THR 0  /* Transmitter Holding Register (write) */
+#define IER 1  /* Interrupt Enable Register */
+#define IIR 2  /* Interrupt Identification Register */
+#define LCR 3  /* Line Control Register */
+#define MCR 4  /* Modem Control Register */
+#define LSR 5  /* Line Status Register */
+#define MSR 6  /* Modem Status Register */
+
+#define FCR 2  /* FIFO Control Register (write) */
+
+#define LSR_DATA_READY    0x01
+#define LSR_OVERRUN       0x02
+#define LSR_PARITY        0x04
+#define LSR_FRAMING       0x08
+#define LSR_THRE          0x20
+#define LSR_TEMT          0x40
+#define IER_RX_DATA       0x01
+#define IER_THRE          0x02
+#define IER_MODEM         0x08
+#define IIR_FIFO_ON       0xC0
+#define FCR_ENABLE_8      0x87  /* Enable + clear FIFOs, RX trigger at 8 bytes */
+#define MCR_DTR           0x01
+#define MCR_RTS           0x02
+#define MSR_CTS           0x10
+#define UART_FIFO_DEPTH   16
+#define SIVR_PORT         0x807F
+#define SERIAL_INT_VECTOR 0x60
+
+/*============================================================================
+ * Serial Port
+ *============================================================================*/
+
+volatile unsigned char tx_active = 0;  /* THRE interrupt enabled */
+
+unsigned short serial_divisor = BAUD_DIVISOR(9600);
+unsigned char uart_fifo = 0;           /* 16550A FIFOs detected */
+unsigned char tx_burst = 1;            /* Bytes written per THRE interrupt */
+unsigned char ier_rx = IER_RX_DATA;    /* IER bits while the transmitter idles */
+
+unsigned short uart_base = 0;
+void (__interrupt __far *old_serial_handler)() = 0;
+
+unsigned short get_uart_base(void) {
+    unsigned short base = 0;
+    __asm {
+        push es
+        mov ax, 0x0040
+        mov es, ax
+        xor bx, bx
+        mov ax, es:[bx]
+        mov base, ax
+        pop es
+    }
+    return base;
+}
+
+unsigned char read_uart(unsigned char reg) {
+    unsigned char value = 0;
+    unsigned short addr = uart_base + reg;
+    __asm {
+        mov dx, addr
+        in al, dx
+        mov value, al
+    }
+    return value;
+}
+
+void write_uart(unsigned char reg, unsigned char value) {
+    unsigned short addr = uart_base + reg;
+    __asm {
+        mov dx, addr
+        mov al, value
+        out dx, al
+    }
+}
+
+/* Move queued bytes into THR - caller has interrupts disabled */
+void tx_fill(void) {
+    unsigned char n = tx_burst;
+
+    if (flow_control && !(read_uart(MSR) & MSR_CTS)) {
+        return;  /* Peer is holding us off; the MSR interrupt resumes us */
+    }
+    do {
+        write_uart(THR, tx_queue[tx_tail]);
+        tx_tail = (tx_tail + 1) & TX_QUEUE_MASK;
+    } while (--n && tx_head != tx_tail);
+}
+
+void __interrupt __far serial_interrupt_handler(void) {
+    unsigned char lsr, c;
+    unsigned short next_head;
+    (void)read_uart(IIR);
+    lsr = read_uart(LSR);
+    while (lsr & LSR_DATA_READY) {
+        if (lsr & LSR_OVERRUN) uart_overruns++;
+        if (lsr & (LSR_PARITY | LSR_FRAMING)) uart_frame_errors++;
+        c = read_uart(RBR);
+        next_head = (rx_head + 1) & RX_BUF_MASK;
+        if (next_head != rx_tail) {
+            rx_buf[rx_head] = c;
+            rx_head = next_head;
+        } else {
+            rx_overflows++;
+        }
+        lsr = read_uart(LSR);
+    }
+
+    /* Ask the peer to pause before the ring fills */
+    if (flow_control && !rx_throttled &&
+        ((rx_head - rx_tail) & RX_BUF_MASK) >= RX_HIGH_WATER) {
+        write_uart(MCR, MCR_DTR);
+        rx_throttled = 1;
+    }
+
+    /* Feed the transmitter, or stop THRE interrupts once the queue is empty */
+    if (tx_active && (lsr & LSR_THRE)) {
+        if (tx_head != tx_tail) {
+            tx_fill();
+        } else {
+            write_uart(IER, ier_rx);
+            tx_active = 0;
+        }
+    }
+    if (flow_control) {
+        (void)read_uart(MSR);  /* Clear a pending modem status interrupt */
+    }
+}
+
+/* Everything is interrupt driven here */
+void serial_poll(void) {
+}
+
+/* Raise RTS again once rx_getchar has drained the ring */
+void rx_unthrottle(void) {
+    __asm { cli }
+    write_uart(MCR, MCR_DTR | MCR_RTS);
+    rx_throttled = 0;
+    __asm { sti }
+}
+
+/* Start the THRE interrupt chain if the transmitter is idle */
+void tx_kick(void) {
+    __asm { cli }
+    if (!tx_active && tx_head != tx_tail) {
+        /* Prime THR so the UART raises THRE once these bytes move out */
+        if (read_uart(LSR) & LSR_THRE) {
+            tx_fill();
+        }
+        tx_active = 1;
+        write_uart(IER, ier_rx | IER_THRE);
+    }
+    __asm { sti }
+}
+
+unsigned char tx_idle(void) {
+    return (read_uart(LSR) & LSR_TEMT) != 0;
+}
+
+void (__interrupt __far *get_vector(unsigned char intnum))() {
+    void __far *handler = 0;
+    __asm {
+        mov ah, 0x35
+        mov al, intnum
+        int 0x21
+        mov word ptr handler, bx
+        mov word ptr handler+2, es
+    }
+    return (void (__interrupt __far *)())handler;
+}
+
+void set_vector(unsigned char intnum, void (__interrupt __far *handler)()) {
+    __asm {
+        push ds
+        mov ah, 0x25
+        mov al, intnum
+        lds dx, dword ptr handler
+        int 0x21
+        pop ds
+    }
+}
+
+void init_int61(void) {
+    __asm {
+        mov ah, 0x00
+        int 0x61
+    }
+}
+
+void write_sivr(unsigned char vector) {
+    __asm {
+        mov ah, 0x1C
+        mov al, 0
+        mov bh, 5
+        mov bl, vector
+        mov dx, SIVR_PORT
+        int 0x61
+    }
+}
+
+/* Program the baud rate divisor latch (interrupts off while DLAB is set) */
+void set_baud_divisor(unsigned short divisor) {
+    __asm { cli }
+    write_uart(LCR, 0x80);
+    write_uart(0, (unsigned char)divisor);
+    write_uart(1, (unsigned char)(divisor >> 8));
+    write_uart(LCR, 0x03);
+    __asm { sti }
+    serial_divisor = divisor;
+}
+
+void init_serial(unsigned short divisor) {
+    uart_base = get_uart_base();
+    write_uart(IER, 0x00);
+    set_baud_divisor(divisor);
+    write_uart(MCR, MCR_DTR | MCR_RTS);
+
+    /* Enable FIFOs; an 8250/16450 ignores FCR and keeps IIR bits 6-7 clear */
+    write_uart(FCR, FCR_ENABLE_8);
+    if ((read_uart(IIR) & IIR_FIFO_ON) == IIR_FIFO_ON) {
+        uart_fifo = 1;
+        tx_burst = UART_FIFO_DEPTH;
+    } else {
+        write_uart(FCR, 0x00);
+    }
+    if (flow_control) {
+        ier_rx = IER_RX_DATA | IER_MODEM;
+    }
+    read_uart(LSR);
+    read_uart(RBR);
+    read_uart(IIR);
+    read_uart(MSR);
+    old_serial_handler = get_vector(SERIAL_INT_VECTOR);
+    set_vector(SERIAL_INT_VECTOR, serial_interrupt_handler);
+    init_int61();
+    __asm { sti }
+    write_sivr(SERIAL_INT_VECTOR);
+    write_uart(IER, ier_rx);
+}
+
+void cleanup_serial(void) {
+    tx_flush();
+    write_uart(IER, 0x00);
+    if (uart_fifo) {
+        write_uart(FCR, 0x00);
+    }
+    write_sivr(0);
+    set_vector(SERIAL_INT_VECTOR, old_serial_handler);
+}
+
+/*============================================================================
+ * Checksum
+ *============================================================================*/
+
+#ifdef ASM_CHECKSUM
+
+/* Word-at-a-time one's complement sum. LODSW reads the data as
+   little-endian words; the sum is byte order independent (RFC 1071), so
+   it is run byte-swapped and swapped back at the end. Carries are added
+   back in with ADC as they happen. Any alignment works, and on the
+   80C88's 8-bit bus an odd address costs nothing extra. Only built with
+   -DASM_CHECKSUM until bench.exe has checked it on the Portfolio. */
+unsigned long checksum_add(unsigned long sum, unsigned char *data, unsigned short len) {
+    unsigned short acc;
+
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    acc = (unsigned short)sum;
+    acc = (acc << 8) | (acc >> 8);
+
+    __asm {
+        push si
+        cld
+        mov si, data
+        mov dx, acc
+        mov cx, len
+        shr cx, 1
+        mov bx, cx
+        and bx, 3           ; Words left over after the unrolled loop
+        shr cx, 1
+        shr cx, 1           ; Groups of four words
+        clc
+        jcxz words
+    four:
+        lodsw
+        adc dx, ax
+        lodsw
+        adc dx, ax
+        lodsw
+        adc dx, ax
+        lodsw
+        adc dx, ax
+        loop four
+    words:
+        mov cx, bx
+        jcxz fold
+    one:
+        lodsw
+        adc dx, ax
+        loop one
+    fold:
+        adc dx, 0           ; Can't carry out: DX < 0FFFFh while CF is set
+        test byte ptr len, 1
+        jz swap
+        lodsb               ; Odd byte is the high half of a padded word
+        xor ah, ah
+        add dx, ax
+        adc dx, 0
+    swap:
+        xchg dh, dl
+        mov acc, dx
+        pop si
+    }
+    return acc;
+}
+
+#else
+
+unsigned long checksum_add(unsigned long sum, unsigned char *data, unsigned short len) {
+    return checksum_add_c(sum, data, len);
+}
+
+#endif /* ASM_CHECKSUM */
+
+/*============================================================================
+ * Timer
+ *============================================================================*/
+
+/* Read BIOS tick counter from 0040:006C */
+unsigned long get_tick_count(void) {
+    unsigned long ticks = 0;
+    __asm {
+        push es
+        mov ax, 0x0040
+        mov es, ax
+        mov bx, 0x006C
+        mov ax, es:[bx]
+        mov dx, es:[bx+2]
+        mov word ptr ticks, ax
+        mov word ptr ticks+2, dx
+        pop es
+    }
+    return ticks;
+}
@@ -0,0 +1,376 @@
+/* pal_posix.c - Platform layer for a POSIX host (pty serial line, clock, console, DOS calls)
+ *
+ * Lets httpofo run unmodified under Linux: the serial line is the master
+ * side of a pseudo-terminal, paced to the selected baud rate, so a host
+ * can attach with slattach and exercise the stack at full speed or at
+ * Portfolio line rates.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <conio.h>
+#include <dos.h>
+#include "network.h"
+#include "platform.h"
+
+/*============================================================================
+ * Serial Port
+ *============================================================================*/
+
+#define TX_BURST   16    /* Bytes that may go out back to back, like a FIFO */
+#define IDLE_SPINS 64    /* Empty polls before the main loop sleeps */
+#define IDLE_SLEEP 500   /* Microseconds */
+
+unsigned short serial_divisor = BAUD_DIVISOR(9600);
+unsigned char uart_fifo = 0;
+
+int pty_fd = -1;                /* Master side, our end of the line */
+int pty_slave_fd = -1;          /* Held open so the line survives re-attaching */
+long long byte_ns = 0;          /* Time one 10-bit character takes on the line */
+long long tx_next_ns = 0;       /* When the line can take the next byte */
+unsigned short idle_spins = 0;
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Move as many queued bytes to the pty as the baud rate allows */
+unsigned short pty_write(void) {
+    long long now = now_ns();
+    unsigned short head, n, sent = 0;
+    long long allowed;
+    ssize_t w;
+
+    if (tx_next_ns < now - TX_BURST * byte_ns) {
+        tx_next_ns = now - TX_BURST * byte_ns;
+    }
+    allowed = (now - tx_next_ns) / byte_ns;
+
+    while (allowed > 0 && tx_head != tx_tail) {
+        head = tx_head;
+        n = (head > tx_tail ? head : TX_QUEUE_SIZE) - tx_tail;
+        if (n > allowed) n = (unsigned short)allowed;
+        w = write(pty_fd, (void *)&tx_queue[tx_tail], n);
+        if (w <= 0) break;
+        tx_tail = (tx_tail + (unsigned short)w) & TX_QUEUE_MASK;
+        tx_next_ns += w * byte_ns;
+        allowed -= w;
+        sent += (unsigned short)w;
+    }
+    return sent;
+}
+
+/* Fill the receive ring from the pty; what doesn't fit stays in the kernel */
+unsigned short pty_read(void) {
+    unsigned short tail, n, got = 0;
+    ssize_t r;
+
+    for (;;) {
+        tail = rx_tail;
+        n = (rx_head >= tail ? RX_BUF_SIZE : tail) - rx_head;
+        if (((rx_head + n) & RX_BUF_MASK) == tail) n--;  /* Keep one slot free */
+        if (n == 0) break;
+        r = read(pty_fd, (void *)&rx_buf[rx_head], n);
+        if (r <= 0) break;
+        rx_head = (rx_head + (unsigned short)r) & RX_BUF_MASK;
+        got += (unsigned short)r;
+        if ((unsigned short)r < n) break;
+    }
+    return got;
+}
+
+void serial_poll(void) {
+    if (pty_fd < 0) return;
+    if (pty_read() || pty_write() || tx_head != tx_tail) {
+        idle_spins = 0;
+    } else if (++idle_spins >= IDLE_SPINS) {
+        usleep(IDLE_SLEEP);
+    }
+}
+
+/* The ring never drops bytes here, so there is no peer to release */
+void rx_unthrottle(void) {
+    rx_throttled = 0;
+}
+
+void tx_kick(void) {
+    if (pty_fd >= 0) pty_write();
+}
+
+unsigned char tx_idle(void) {
+    return 1;
+}
+
+void set_baud_divisor(unsigned short divisor) {
+    serial_divisor = divisor;
+    byte_ns = 10LL * 1000000000LL / DIVISOR_BAUD(divisor);
+}
+
+void init_serial(unsigned short divisor) {
+    struct termios tio;
+    char *name;
+
+    set_baud_divisor(divisor);
+    pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty_fd < 0 || grantpt(pty_fd) < 0 || unlockpt(pty_fd) < 0 ||
+        (name = ptsname(pty_fd)) == NULL) {
+        perror("posix_openpt");
+        exit(1);
+    }
+    pty_slave_fd = open(name, O_RDWR | O_NOCTTY);
+    if (pty_slave_fd >= 0 && tcgetattr(pty_slave_fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(pty_slave_fd, TCSANOW, &tio);
+    }
+    fcntl(pty_fd, F_SETFL, fcntl(pty_fd, F_GETFL) | O_NONBLOCK);
+
+    print_str("Serial line: ");
+    print_str(name);
+    print_str("\r\n");
+}
+
+void cleanup_serial(void) {
+    tx_flush();
+    close(pty_fd);
+    close(pty_slave_fd);
+    pty_fd = -1;
+}
+
+/*============================================================================
+ * Checksum
+ *============================================================================*/
+
+unsigned long checksum_add(unsigned long sum, unsigned char *data, unsigned short len) {
+    return checksum_add_c(sum, data, len);
+}
+
+/*============================================================================
+ * Timer
+ *============================================================================*/
+
+/* BIOS ticks run at 1193182 / 65536 = 18.2 Hz */
+unsigned long get_tick_count(void) {
+    return (unsigned long)(now_ns() / 1000000LL * 1193182LL / 65536000LL);
+}
+
+/*============================================================================
+ * Console
+ *============================================================================*/
+
+struct termios console_saved;
+unsigned char console_ready = 0;
+unsigned char console_tty = 0;
+volatile sig_atomic_t quit_requested = 0;
+
+void console_restore(void) {
+    tcsetattr(0, TCSANOW, &console_saved);
+}
+
+void on_quit_signal(int sig) {
+    (void)sig;
+    quit_requested = 1;
+}
+
+/* Unbuffered output, and single keys without echo when stdin is a terminal */
+void console_init(void) {
+    struct termios raw;
+
+    if (console_ready) return;
+    console_ready = 1;
+    setvbuf(stdout, NULL, _IONBF, 0);
+    signal(SIGINT, on_quit_signal);
+    signal(SIGTERM, on_quit_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (isatty(0) && tcgetattr(0, &console_saved) == 0) {
+        raw = console_saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_iflag &= ~(IXON | ICRNL);  /* Let Ctrl+Q through */
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(0, TCSANOW, &raw);
+        atexit(console_restore);
+        console_tty = 1;
+    }
+}
+
+int putch(int c) {
+    console_init();
+    return putchar(c);
+}
+
+int kbhit(void) {
+    struct pollfd pfd;
+
+    console_init();
+    if (quit_requested) return 1;
+    if (!console_tty) return 0;
+    pfd.fd = 0;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Ctrl+C and SIGTERM read as Ctrl+Q so the server shuts down cleanly */
+int getch(void) {
+    unsigned char c;
+
+    console_init();
+    if (quit_requested || read(0, &c, 1) != 1) return 0x11;
+    return c;
+}
+
+/*============================================================================
+ * DOS File Calls
+ *============================================================================*/
+
+#define DOS_FILE_NOT_FOUND 2
+#define DOS_ACCESS_DENIED  5
+#define DOS_NO_MORE_FILES  18
+
+/* Copy a DOS path, turning '\' into '/' */
+void host_path(char *out, const char *path) {
+    unsigned short i;
+
+    for (i = 0; path[i] && i < PATH_MAX - 1; i++) {
+        out[i] = path[i] == '\\' ? '/' : path[i];
+    }
+    out[i] = '\0';
+}
+
+unsigned dos_error(void) {
+    return errno == ENOENT || errno == ENOTDIR ? DOS_FILE_NOT_FOUND : DOS_ACCESS_DENIED;
+}
+
+unsigned _dos_open(const char *path, unsigned mode, int *handle) {
+    char p[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    host_path(p, path);
+    fd = open(p, (mode & 3) == 0 ? O_RDONLY : (mode & 3) == 1 ? O_WRONLY : O_RDWR);
+    if (fd < 0) return dos_error();
+    if (fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+        close(fd);  /* DOS can't open a directory as a file */
+        return DOS_ACCESS_DENIED;
+    }
+    *handle = fd;
+    return 0;
+}
+
+unsigned _dos_creat(const char *path, unsigned attr, int *handle) {
+    char p[PATH_MAX];
+    int fd;
+
+    (void)attr;
+    host_path(p, path);
+    fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return dos_error();
+    *handle = fd;
+    return 0;
+}
+
+unsigned _dos_read(int handle, void *buf, unsigned count, unsigned *bytes) {
+    ssize_t r = read(handle, buf, count);
+    if (r < 0) return DOS_ACCESS_DENIED;
+    *bytes = (unsigned)r;
+    return 0;
+}
+
+unsigned _dos_write(int handle, const void *buf, unsigned count, unsigned *bytes) {
+    ssize_t w = write(handle, buf, count);
+    if (w < 0) return DOS_ACCESS_DENIED;
+    *bytes = (unsigned)w;
+    return 0;
+}
+
+unsigned _dos_close(int handle) {
+    return close(handle) == 0 ? 0 : DOS_ACCESS_DENIED;
+}
+
+/* One search at a time, as the server only ever walks one directory */
+DIR *find_dir = NULL;
+char find_base[PATH_MAX];
+char find_pattern[PATH_MAX];
+unsigned find_attr;
+
+/* Fill a find_t from stat; 0 if DOS wouldn't report this entry */
+unsigned char find_fill(struct find_t *buf, const char *path, const char *name,
+                        unsigned attr) {
+    struct stat st;
+    struct tm *tm;
+
+    if (strlen(name) > 12 || stat(path, &st) != 0) return 0;
+    if (S_ISDIR(st.st_mode) && !(attr & _A_SUBDIR)) return 0;
+
+    memset(buf, 0, sizeof(*buf));
+    buf->attrib = S_ISDIR(st.st_mode) ? _A_SUBDIR : _A_ARCH;
+    buf->size = (unsigned long)st.st_size;
+    tm = localtime(&st.st_mtime);
+    buf->wr_date = (unsigned short)(((tm->tm_year - 80) << 9) |
+                                    ((tm->tm_mon + 1) << 5) | tm->tm_mday);
+    buf->wr_time = (unsigned short)((tm->tm_hour << 11) | (tm->tm_min << 5) |
+                                    (tm->tm_sec / 2));
+    strcpy(buf->name, name);
+    return 1;
+}
+
+unsigned _dos_findfirst(const char *path, unsigned attr, struct find_t *buf) {
+    char p[PATH_MAX];
+    char *slash, *name;
+
+    host_path(p, path);
+    if (find_dir) {
+        closedir(find_dir);
+        find_dir = NULL;
+    }
+    slash = strrchr(p, '/');
+    name = slash ? slash + 1 : p;
+
+    if (!strpbrk(name, "*?")) {
+        return find_fill(buf, p, name, attr) ? 0 : DOS_FILE_NOT_FOUND;
+    }
+
+    /* "*.*" matches every name on DOS, dotted or not */
+    strcpy(find_pattern, strcmp(name, "*.*") == 0 ? "*" : name);
+    if (slash) {
+        *slash = '\0';
+        strcpy(find_base, slash == p ? "/" : p);
+    } else {
+        strcpy(find_base, ".");
+    }
+    find_attr = attr;
+    find_dir = opendir(find_base);
+    if (!find_dir) return DOS_FILE_NOT_FOUND;
+    return _dos_findnext(buf);
+}
+
+unsigned _dos_findnext(struct find_t *buf) {
+    char p[PATH_MAX * 2];
+    struct dirent *de;
+
+    if (!find_dir) return DOS_NO_MORE_FILES;
+    while ((de = readdir(find_dir)) != NULL) {
+        if (fnmatch(find_pattern, de->d_name, FNM_CASEFOLD) != 0) continue;
+        snprintf(p, sizeof(p), "%s/%s", find_base, de->d_name);
+        if (find_fill(buf, p, de->d_name, find_attr)) return 0;
+    }
+    closedir(find_dir);
+    find_dir = NULL;
+    return DOS_NO_MORE_FILES;
+}
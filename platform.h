@@ -0,0 +1,49 @@
+/* platform.h - Interface between the network stack and the platform layer
+ *
+ * The stack in network.c owns the serial rings below. A platform layer
+ * moves bytes between them and the line: pal_dos.c drives the Portfolio
+ * UART from its interrupt handler, pal_posix.c pumps a pseudo-terminal
+ * from serial_poll so the same code can run under Linux.
+ */
+
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+/*============================================================================
+ * Serial Rings (defined in network.c)
+ *============================================================================*/
+
+#define RX_BUF_MASK   (RX_BUF_SIZE - 1)
+#define RX_HIGH_WATER (RX_BUF_SIZE * 3 / 4)  /* Throttle the peer at this fill level */
+#define RX_LOW_WATER  (RX_BUF_SIZE / 4)      /* Let it resume here */
+#define TX_QUEUE_MASK (TX_QUEUE_SIZE - 1)
+
+extern volatile unsigned char rx_buf[];
+extern volatile unsigned short rx_head;
+extern volatile unsigned short rx_tail;
+extern volatile unsigned char rx_throttled;
+
+extern volatile unsigned char tx_queue[];
+extern volatile unsigned short tx_head;
+extern volatile unsigned short tx_tail;
+
+/*============================================================================
+ * Platform Hooks
+ *============================================================================*/
+
+/* Service the line from the main loop (no-op where interrupt driven) */
+void serial_poll(void);
+
+/* Start sending whatever has been queued since the transmitter went idle */
+void tx_kick(void);
+
+/* Shift register empty - the last queued byte has left */
+unsigned char tx_idle(void);
+
+/* Ring has drained below RX_LOW_WATER - let the peer send again */
+void rx_unthrottle(void);
+
+/* checksum_add (network.h) also lives here, so it can be hand-written
+   for the CPU; the result may come back already folded */
+
+#endif /* PLATFORM_H */
@@ -1,24 +1,28 @@
 #!/bin/bash
 # Setup SLIP connection on macOS/Linux host for testing
 #
-# Usage: sudo ./setup_slip.sh [serial_device]
+# Usage: sudo ./setup_slip.sh [serial_device] [baud] [slip|cslip]
 #
 # Example:
 #   sudo ./setup_slip.sh /dev/ttyUSB0      # Linux
 #   sudo ./setup_slip.sh /dev/tty.usbserial # macOS
+#   sudo ./setup_slip.sh /dev/ttyUSB0 38400 # run httpofo with -b 38400 or -a
+#   sudo ./setup_slip.sh /dev/ttyUSB0 9600 cslip # run httpofo with -c
 
 set -e
 
 SERIAL_DEV="${1:-/dev/ttyUSB0}"
 HOST_IP="192.168.7.1"
 PORTFOLIO_IP="192.168.7.2"
-BAUD="9600"
+BAUD="${2:-9600}"
+PROTO="${3:-slip}"
 
 echo "=== Portfolio SLIP Setup ==="
 echo "Serial device: $SERIAL_DEV"
 echo "Host IP:       $HOST_IP"
 echo "Portfolio IP:  $PORTFOLIO_IP"
 echo "Baud rate:     $BAUD"
+echo "Protocol:      $PROTO"
 echo ""
 
 # Check if device exists
@@ -36,13 +40,17 @@ sleep 1
 
 # Start slattach
 echo "Starting SLIP on $SERIAL_DEV..."
-slattach -s "$BAUD" -p slip "$SERIAL_DEV" &
+slattach -s "$BAUD" -p "$PROTO" "$SERIAL_DEV" &
 SLATTACH_PID=$!
 sleep 2
 
 # Check if slattach is running
 if ! kill -0 $SLATTACH_PID 2>/dev/null; then
     echo "Error: slattach failed to start"
+    echo "The kernel needs SLIP support: try 'modprobe slip'"
+    if [ "$PROTO" = "cslip" ]; then
+        echo "cslip also needs CONFIG_SLIP_COMPRESSED"
+    fi
     exit 1
 fi
 
@@ -50,10 +58,10 @@ fi
 echo "Configuring IP addresses..."
 if [[ "$OSTYPE" == "darwin"* ]]; then
     # macOS
-    ifconfig sl0 "$HOST_IP" "$PORTFOLIO_IP" up
+    ifconfig sl0 "$HOST_IP" "$PORTFOLIO_IP" mtu 576 up
 else
     # Linux
-    ifconfig sl0 "$HOST_IP" pointopoint "$PORTFOLIO_IP" up
+    ifconfig sl0 "$HOST_IP" pointopoint "$PORTFOLIO_IP" mtu 576 up
 fi
 
 echo ""
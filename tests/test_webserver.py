@@ -8,6 +8,10 @@ Prerequisites:
      sudo ifconfig sl0 192.168.7.1 pointopoint 192.168.7.2 up
 
   2. Portfolio running webserver.exe in www/ directory
+     (with -w for the PUT tests, which are skipped otherwise). Files
+     they upload are deleted from WWW_DIR afterwards, which is only
+     possible when it is on this machine (the host build); on a
+     Portfolio, delete pipeline.txt by hand.
 
   3. Install dependencies:
      pip install pytest requests
@@ -18,6 +22,7 @@ Usage:
   pytest test_webserver.py -v --tb=short       # shorter tracebacks
 """
 
+import os
 import pytest
 import requests
 import socket
@@ -28,10 +33,54 @@ SERVER_IP = "192.168.7.2"
 SERVER_PORT = 80
 BASE_URL = f"http://{SERVER_IP}:{SERVER_PORT}"
 
+# Directory the server is serving, for cleaning up after PUT tests
+WWW_DIR = os.environ.get("WWW_DIR",
+                         os.path.join(os.path.dirname(__file__), "..", "www"))
+
 # Timeout for requests (Portfolio is slow!)
 TIMEOUT = 30
 
 
+def read_response(f):
+    """Read one response from a raw socket's file: (status, headers, body).
+
+    The body is read to its Content-Length, or to the end of the
+    connection if there isn't one.
+    """
+    status = f.readline().decode("latin-1").strip()
+    headers = {}
+    while True:
+        line = f.readline().decode("latin-1").strip()
+        if not line:
+            break
+        name, _, value = line.partition(":")
+        headers[name.strip().lower()] = value.strip()
+    if "content-length" in headers:
+        body = f.read(int(headers["content-length"]))
+    else:
+        body = f.read()
+    return status, headers, body
+
+
+def connection_closed(f):
+    """True if the server closes the connection after its response."""
+    try:
+        return f.read(1) == b""
+    except socket.timeout:
+        return False
+
+
+@pytest.fixture
+def uploaded():
+    """List of names a test PUTs, deleted from WWW_DIR afterwards."""
+    names = []
+    yield names
+    for name in names:
+        path = os.path.join(WWW_DIR, name)
+        if os.path.exists(path):
+            os.remove(path)
+
+
 class TestBasicHTTP:
     """Basic HTTP functionality tests."""
 
@@ -222,6 +271,182 @@ class TestLowLevel:
             sock.close()
 
 
+class TestKeepAlive:
+    """Persistent connection tests."""
+
+    def test_content_length(self):
+        """200 responses should carry a Content-Length."""
+        r = requests.get(f"{BASE_URL}/about.htm", timeout=TIMEOUT)
+        assert r.status_code == 200
+        assert r.headers.get("Content-Length") == str(len(r.content))
+
+    def test_two_requests_one_session(self):
+        """A session should get both responses over one connection."""
+        with requests.Session() as s:
+            r1 = s.get(f"{BASE_URL}/", timeout=TIMEOUT)
+            assert r1.status_code == 200
+            assert r1.headers.get("Connection") == "keep-alive"
+            r2 = s.get(f"{BASE_URL}/about.htm", timeout=TIMEOUT)
+            assert r2.status_code == 200
+            assert "About" in r2.text
+
+    def test_two_requests_one_socket(self):
+        """A second request should be answered on the same socket."""
+        sock = socket.create_connection((SERVER_IP, SERVER_PORT), timeout=TIMEOUT)
+        f = sock.makefile("rb")
+        try:
+            sock.send(b"GET /about.htm HTTP/1.1\r\n\r\n")
+            status, headers, body = read_response(f)
+            assert "200 OK" in status
+            sock.send(b"GET /docs/readme.txt HTTP/1.1\r\n\r\n")
+            status, headers, body = read_response(f)
+            assert "200 OK" in status
+            assert b"SLIP" in body
+        finally:
+            sock.close()
+
+    def test_idle_connection_shares_window(self):
+        """A connection kept open should not hold up a new one."""
+        sock = socket.create_connection((SERVER_IP, SERVER_PORT), timeout=TIMEOUT)
+        f = sock.makefile("rb")
+        try:
+            sock.send(b"GET /about.htm HTTP/1.1\r\n\r\n")
+            status, headers, body = read_response(f)
+            assert "200 OK" in status
+            start = time.time()
+            r = requests.get(f"{BASE_URL}/docs/readme.txt", timeout=TIMEOUT)
+            assert r.status_code == 200
+            assert time.time() - start < 5
+        finally:
+            sock.close()
+
+    def test_tcp_keepalive_answered(self):
+        """TCP keepalive probes on an open connection should be ACKed."""
+        sock = socket.create_connection((SERVER_IP, SERVER_PORT), timeout=TIMEOUT)
+        f = sock.makefile("rb")
+        try:
+            sock.send(b"GET /about.htm HTTP/1.1\r\n\r\n")
+            status, headers, body = read_response(f)
+            assert "200 OK" in status
+            # Two unanswered probes a second apart and Linux drops the socket
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_KEEPALIVE, 1)
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_KEEPIDLE, 1)
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_KEEPINTVL, 1)
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_KEEPCNT, 2)
+            time.sleep(5)
+            sock.send(b"GET /about.htm HTTP/1.1\r\n\r\n")
+            status, headers, body = read_response(f)
+            assert "200 OK" in status
+        finally:
+            sock.close()
+
+    def test_connection_close(self):
+        """Connection: close should close the connection after the response."""
+        sock = socket.create_connection((SERVER_IP, SERVER_PORT), timeout=TIMEOUT)
+        f = sock.makefile("rb")
+        try:
+            sock.send(b"GET /about.htm HTTP/1.1\r\nConnection: close\r\n\r\n")
+            status, headers, body = read_response(f)
+            assert "200 OK" in status
+            assert headers.get("connection") == "close"
+            assert connection_closed(f)
+        finally:
+            sock.close()
+
+    def test_http10_closes(self):
+        """HTTP/1.0 without keep-alive should close the connection."""
+        sock = socket.create_connection((SERVER_IP, SERVER_PORT), timeout=TIMEOUT)
+        f = sock.makefile("rb")
+        try:
+            sock.send(b"GET /about.htm HTTP/1.0\r\n\r\n")
+            status, headers, body = read_response(f)
+            assert "200 OK" in status
+            assert connection_closed(f)
+        finally:
+            sock.close()
+
+    def test_directory_listing_closes(self):
+        """A directory listing has no length, so it should end the connection."""
+        sock = socket.create_connection((SERVER_IP, SERVER_PORT), timeout=TIMEOUT)
+        f = sock.makefile("rb")
+        try:
+            sock.send(b"GET /docs/ HTTP/1.1\r\n\r\n")
+            status, headers, body = read_response(f)
+            assert "200 OK" in status
+            assert "content-length" not in headers
+            assert headers.get("connection") == "close"
+            assert b"readme.txt" in body.lower()
+        finally:
+            sock.close()
+
+    def test_put_then_pipelined_get(self, uploaded):
+        """A request sent right behind a PUT body should not end up in the file."""
+        uploaded.append("pipeline.txt")
+        sock = socket.create_connection((SERVER_IP, SERVER_PORT), timeout=TIMEOUT)
+        f = sock.makefile("rb")
+        try:
+            sock.send(b"PUT /pipeline.txt HTTP/1.1\r\nContent-Length: 10\r\n\r\n"
+                      b"0123456789"
+                      b"GET /pipeline.txt HTTP/1.1\r\nConnection: close\r\n\r\n")
+            status, headers, body = read_response(f)
+            if "405" in status:
+                pytest.skip("server not started with -w")
+            assert "201" in status
+            status, headers, body = read_response(f)
+            assert "200 OK" in status
+            assert body == b"0123456789"
+        finally:
+            sock.close()
+
+
+class TestConditionalGET:
+    """Cache validation tests."""
+
+    def test_validators_present(self):
+        """Files should carry an ETag and a Last-Modified date."""
+        r = requests.get(f"{BASE_URL}/about.htm", timeout=TIMEOUT)
+        assert r.status_code == 200
+        assert r.headers.get("ETag", "").startswith('"')
+        assert r.headers.get("Last-Modified", "").endswith(" GMT")
+
+    def test_if_none_match_file(self):
+        """The current ETag should get a 304 with no body."""
+        r = requests.get(f"{BASE_URL}/about.htm", timeout=TIMEOUT)
+        etag = r.headers["ETag"]
+        r = requests.get(f"{BASE_URL}/about.htm", timeout=TIMEOUT,
+                         headers={"If-None-Match": etag})
+        assert r.status_code == 304
+        assert r.content == b""
+        assert r.headers.get("ETag") == etag
+
+    def test_if_none_match_directory(self):
+        """A directory listing's ETag should get a 304 with no body."""
+        r = requests.get(f"{BASE_URL}/docs/", timeout=TIMEOUT)
+        assert r.status_code == 200
+        etag = r.headers["ETag"]
+        r = requests.get(f"{BASE_URL}/docs/", timeout=TIMEOUT,
+                         headers={"If-None-Match": etag})
+        assert r.status_code == 304
+        assert r.content == b""
+
+    def test_if_modified_since(self):
+        """The Last-Modified date sent back should get a 304."""
+        r = requests.get(f"{BASE_URL}/about.htm", timeout=TIMEOUT)
+        r = requests.get(f"{BASE_URL}/about.htm", timeout=TIMEOUT,
+                         headers={"If-Modified-Since": r.headers["Last-Modified"]})
+        assert r.status_code == 304
+        assert r.content == b""
+
+    def test_stale_etag(self):
+        """An ETag that doesn't match should get the full file."""
+        full = requests.get(f"{BASE_URL}/about.htm", timeout=TIMEOUT)
+        r = requests.get(f"{BASE_URL}/about.htm", timeout=TIMEOUT,
+                         headers={"If-None-Match": '"00000000-00000000"'})
+        assert r.status_code == 200
+        assert r.content == full.content
+        assert len(r.content) > 0
+
+
 # Stress test - run separately as it takes longer
 class TestStress:
     """Stress tests - may take a while."""